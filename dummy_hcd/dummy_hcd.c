@@ -25,6 +25,7 @@
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/ioport.h>
 #include <linux/slab.h>
@@ -38,6 +39,8 @@
 #include <linux/usb/gadget.h>
 #include <linux/usb/hcd.h>
 #include <linux/scatterlist.h>
+#include <linux/ctype.h>
+#include <linux/uaccess.h>
 
 #include <asm/byteorder.h>
 #include <linux/io.h>
@@ -59,10 +62,13 @@ MODULE_DESCRIPTION(DRIVER_DESC);
 MODULE_AUTHOR("David Brownell");
 MODULE_LICENSE("GPL");
 
+#define MAX_NUM_UDC	32
+
 struct dummy_hcd_module_parameters {
 	bool is_super_speed;
 	bool is_high_speed;
 	unsigned int num;
+	char *eps[MAX_NUM_UDC];
 };
 
 static struct dummy_hcd_module_parameters mod_data = {
@@ -76,24 +82,56 @@ module_param_named(is_high_speed, mod_data.is_high_speed, bool, S_IRUGO);
 MODULE_PARM_DESC(is_high_speed, "true to simulate HighSpeed connection");
 module_param_named(num, mod_data.num, uint, S_IRUGO);
 MODULE_PARM_DESC(num, "number of emulated controllers");
+module_param_array_named(eps, mod_data.eps, charp, NULL, S_IRUGO);
+MODULE_PARM_DESC(eps, "endpoint list of each controller, e.g. "
+		"\"ep1in-bulk:ep2out-bulk/64:ep-a\"");
 /*-------------------------------------------------------------------------*/
 
+/*
+ * Stream IDs range from 1 to DUMMY_MAX_STREAMS on both the host and the
+ * gadget side.  Stream 0 is reserved by the spec; a stream-enabled gadget
+ * endpoint still keeps a queue for it, which serves a host that didn't
+ * allocate streams.
+ */
+#define DUMMY_MAX_STREAMS	256
+
 /* gadget side driver data structres */
+struct dummy_stream {
+	struct list_head		queue;		/* stream's requests */
+	unsigned			already_seen:1;
+	unsigned			counted:1;	/* in rr_active */
+};
+
 struct dummy_ep {
 	struct list_head		queue;
 	unsigned long			last_io;	/* jiffies timestamp */
 	struct usb_gadget		*gadget;
 	const struct usb_endpoint_descriptor *desc;
 	struct usb_ep			ep;
+	unsigned			burst;		/* packets per burst */
+	u64				sched_bytes;	/* since enabled */
 	unsigned			halted:1;
 	unsigned			wedged:1;
 	unsigned			already_seen:1;
+	unsigned			counted:1;	/* in rr_active */
 	unsigned			setup_stage:1;
 	unsigned			stream_en:1;
+
+	/*
+	 * Requests are also linked into a per-stream queue, so that the
+	 * scheduler finds the requests for a given stream ID without
+	 * walking the whole ep queue.  Endpoints without streams use the
+	 * single nostream queue; otherwise streams[] is indexed by ID,
+	 * with streams[0] for requests that don't use streams.
+	 */
+	struct dummy_stream		nostream;
+	struct dummy_stream		*streams;
+	unsigned			num_streams;
 };
 
 struct dummy_request {
 	struct list_head		queue;		/* ep's requests */
+	struct list_head		stream_queue;	/* stream's requests */
 	struct usb_request		req;
 };
 
@@ -108,6 +146,24 @@ static inline struct dummy_request *usb_request_to_dummy_request
 	return container_of(_req, struct dummy_request, req);
 }
 
+/* returns NULL if the endpoint has no such stream */
+static struct dummy_stream *dummy_ep_stream(struct dummy_ep *ep,
+		unsigned int stream_id)
+{
+	if (!ep->stream_en)
+		return &ep->nostream;
+	if (stream_id > ep->num_streams)
+		return NULL;
+	return &ep->streams[stream_id];
+}
+
+/* caller must hold lock */
+static inline void dummy_unlink_request(struct dummy_request *req)
+{
+	list_del_init(&req->queue);
+	list_del_init(&req->stream_queue);
+}
+
 /*-------------------------------------------------------------------------*/
 
 /*
@@ -217,7 +273,23 @@ static const struct {
 #undef EP_INFO
 };
 
-#define DUMMY_ENDPOINTS	ARRAY_SIZE(ep_info)
+/*
+ * The table above is only the default.  Each instance can be given its own
+ * endpoints with the "eps" module parameter: a ':'-separated list of names
+ * following the conventions above, each optionally followed by "/<limit>"
+ * to cap its maxpacket.  "-bulk" and "-int" suffixes restrict the type,
+ * "in" and "out" the direction; ep0 is always present.  For example
+ * "ep1in-bulk:ep2out-bulk:ep3in-int/64" is a small fixed function device,
+ * "ep-a:ep-b:ep-c" a configurable one.
+ */
+#define DUMMY_MAX_ENDPOINTS	31	/* ep0 plus 15 IN and 15 OUT */
+
+struct dummy_ep_cfg {
+	char				name[16];
+	struct usb_ep_caps		caps;
+	unsigned			maxpacket_limit;
+	u8				address;	/* 0 unless fixed */
+};
 
 /*-------------------------------------------------------------------------*/
 
@@ -237,10 +309,38 @@ enum dummy_rh_state {
 	DUMMY_RH_RUNNING
 };
 
+/*
+ * Each frame is scheduled in passes over the URB list: interrupt and iso
+ * endpoints first, within their reserved share of the frame, and then the
+ * bulk and control endpoints round-robin.  Round-robin order is kept by
+ * splitting each round into the endpoints from rr_cursor on and those
+ * before it, so URBs of any one endpoint are still visited in order.
+ */
+enum dummy_sched_pass {
+	DUMMY_PASS_PERIODIC,
+	DUMMY_PASS_ASYNC_HI,
+	DUMMY_PASS_ASYNC_LO,
+};
+
+struct dummy_sched_stats {
+	u64				frames;
+	u64				saturated;	/* ran out of bandwidth */
+	u64				rounds;		/* round-robin rounds */
+	u64				kicks;		/* ep0-only passes */
+	u64				periodic_bytes;
+	u64				async_bytes;
+};
+
+/* dummy_hcd.sched_flags */
+#define DUMMY_FRAME_DUE		0	/* a full frame, not just a kick */
+#define DUMMY_STOPPING		1	/* don't rearm the timer or tasklet */
+
 struct dummy_hcd {
 	struct dummy			*dum;
 	enum dummy_rh_state		rh_state;
 	struct timer_list		timer;
+	struct tasklet_struct		sched;
+	unsigned long			sched_flags;
 	u32				port_status;
 	u32				old_status;
 	unsigned long			re_timeout;
@@ -250,7 +350,11 @@ struct dummy_hcd {
 	struct urbp			*next_frame_urbp;
 
 	u32				stream_en_ep;
-	u8				num_stream[30 / 2];
+	u16				num_stream[32];	/* by ep index */
+
+	unsigned			rr_cursor;	/* dum->ep[] index */
+	unsigned			rr_active;	/* endpoints last frame */
+	struct dummy_sched_stats	stats;
 
 	unsigned			active:1;
 	unsigned			old_active:1;
@@ -263,7 +367,9 @@ struct dummy {
 	/*
 	 * DEVICE/GADGET side support
 	 */
-	struct dummy_ep			ep[DUMMY_ENDPOINTS];
+	struct dummy_ep			ep[DUMMY_MAX_ENDPOINTS];
+	struct dummy_ep_cfg		ep_cfg[DUMMY_MAX_ENDPOINTS];
+	unsigned			num_eps;
 	int				address;
 	int				callback_usage;
 	struct usb_gadget		gadget;
@@ -280,6 +386,13 @@ struct dummy {
 	 */
 	struct dummy_hcd		*hs_hcd;
 	struct dummy_hcd		*ss_hcd;
+
+#ifdef CONFIG_DEBUG_FS
+	struct dentry			*debugfs;
+	struct mutex			selftest_mutex;
+	char				*selftest_report;
+	size_t				selftest_len;
+#endif
 };
 
 static inline struct dummy_hcd *hcd_to_dummy_hcd(struct usb_hcd *hcd)
@@ -332,7 +445,7 @@ static void nuke(struct dummy *dum, struct dummy_ep *ep)
 		struct dummy_request	*req;
 
 		req = list_entry(ep->queue.next, struct dummy_request, queue);
-		list_del_init(&req->queue);
+		dummy_unlink_request(req);
 		req->req.status = -ESHUTDOWN;
 
 		spin_unlock(&dum->lock);
@@ -352,7 +465,7 @@ static void stop_activity(struct dummy *dum)
 	/* The timer is left running so that outstanding URBs can fail */
 
 	/* nuke any pending requests first, so driver i/o is quiesced */
-	for (i = 0; i < DUMMY_ENDPOINTS; ++i)
+	for (i = 0; i < dum->num_eps; ++i)
 		nuke(dum, &dum->ep[i]);
 
 	/* driver now does any non-usb quiescing necessary */
@@ -504,6 +617,7 @@ static int dummy_enable(struct usb_ep *_ep,
 	struct dummy_ep		*ep;
 	unsigned		max;
 	int			retval;
+	int			i;
 
 	ep = usb_ep_to_dummy_ep(_ep);
 	if (!_ep || !desc || ep->desc || _ep->name == ep0name
@@ -533,6 +647,8 @@ static int dummy_enable(struct usb_ep *_ep,
 	 * especially for "ep9out" style fixed function ones.)
 	 */
 	retval = -EINVAL;
+	if (max > _ep->maxpacket_limit)
+		goto done;
 	switch (usb_endpoint_type(desc)) {
 	case USB_ENDPOINT_XFER_BULK:
 		if (strstr(ep->ep.name, "-iso")
@@ -607,17 +723,38 @@ static int dummy_enable(struct usb_ep *_ep,
 	}
 
 	_ep->maxpacket = max;
+
+	/* SuperSpeed endpoints move up to bMaxBurst + 1 packets at a time */
+	ep->burst = 1;
+	if (dum->gadget.speed == USB_SPEED_SUPER && _ep->comp_desc)
+		ep->burst = _ep->comp_desc->bMaxBurst + 1;
+	ep->sched_bytes = 0;
+
 	if (usb_ss_max_streams(_ep->comp_desc)) {
 		if (!usb_endpoint_xfer_bulk(desc)) {
 			dev_err(udc_dev(dum), "Can't enable stream support on "
 					"non-bulk ep %s\n", _ep->name);
 			return -EINVAL;
 		}
+		ep->num_streams = min_t(unsigned,
+				usb_ss_max_streams(_ep->comp_desc),
+				DUMMY_MAX_STREAMS);
+		/* may be called from the setup() callback, so no sleeping */
+		ep->streams = kcalloc(ep->num_streams + 1,
+				sizeof(*ep->streams), GFP_ATOMIC);
+		if (!ep->streams) {
+			ep->streams = &ep->nostream;
+			ep->num_streams = 0;
+			return -ENOMEM;
+		}
+		for (i = 0; i <= ep->num_streams; i++)
+			INIT_LIST_HEAD(&ep->streams[i].queue);
 		ep->stream_en = 1;
 	}
 	ep->desc = desc;
 
-	dev_dbg(udc_dev(dum), "enabled %s (ep%d%s-%s) maxpacket %d stream %s\n",
+	dev_dbg(udc_dev(dum), "enabled %s (ep%d%s-%s) maxpacket %d burst %d "
+			"streams %d\n",
 		_ep->name,
 		desc->bEndpointAddress & 0x0f,
 		(desc->bEndpointAddress & USB_DIR_IN) ? "in" : "out",
@@ -636,7 +773,7 @@ static int dummy_enable(struct usb_ep *_ep,
 			 val = "ctrl";
 			 break;
 		 } val; }),
-		max, ep->stream_en ? "enabled" : "disabled");
+		max, ep->burst, ep->num_streams);
 
 	/* at this point real hardware should be NAKing transfers
 	 * to that endpoint, until a buffer is queued to it.
@@ -660,8 +797,13 @@ static int dummy_disable(struct usb_ep *_ep)
 
 	spin_lock_irqsave(&dum->lock, flags);
 	ep->desc = NULL;
-	ep->stream_en = 0;
 	nuke(dum, ep);
+	if (ep->stream_en) {
+		kfree(ep->streams);
+		ep->streams = &ep->nostream;
+		ep->num_streams = 0;
+		ep->stream_en = 0;
+	}
 	spin_unlock_irqrestore(&dum->lock, flags);
 
 	dev_dbg(udc_dev(dum), "disabled %s\n", _ep->name);
@@ -680,6 +822,7 @@ static struct usb_request *dummy_alloc_request(struct usb_ep *_ep,
 	if (!req)
 		return NULL;
 	INIT_LIST_HEAD(&req->queue);
+	INIT_LIST_HEAD(&req->stream_queue);
 	return &req->req;
 }
 
@@ -706,6 +849,7 @@ static int dummy_queue(struct usb_ep *_ep, struct usb_request *_req,
 {
 	struct dummy_ep		*ep;
 	struct dummy_request	*req;
+	struct dummy_stream	*stream;
 	struct dummy		*dum;
 	struct dummy_hcd	*dum_hcd;
 	unsigned long		flags;
@@ -731,6 +875,12 @@ static int dummy_queue(struct usb_ep *_ep, struct usb_request *_req,
 	_req->actual = 0;
 	spin_lock_irqsave(&dum->lock, flags);
 
+	stream = dummy_ep_stream(ep, _req->stream_id);
+	if (!stream) {
+		spin_unlock_irqrestore(&dum->lock, flags);
+		return -EINVAL;
+	}
+
 	/* implement an emulated single-request FIFO */
 	if (ep->desc && (ep->desc->bEndpointAddress & USB_DIR_IN) &&
 			list_empty(&dum->fifo_req.queue) &&
@@ -744,13 +894,25 @@ static int dummy_queue(struct usb_ep *_ep, struct usb_request *_req,
 		req->req.complete = fifo_complete;
 
 		list_add_tail(&req->queue, &ep->queue);
+		list_add_tail(&req->stream_queue, &stream->queue);
 		spin_unlock(&dum->lock);
 		_req->actual = _req->length;
 		_req->status = 0;
 		usb_gadget_giveback_request(_ep, _req);
 		spin_lock(&dum->lock);
-	}  else
+	}  else {
 		list_add_tail(&req->queue, &ep->queue);
+		list_add_tail(&req->stream_queue, &stream->queue);
+	}
+
+	/*
+	 * Don't make the host wait for the next frame to see the ep0
+	 * response of a control transfer it has pending, this way setup,
+	 * data and status stages can complete back to back.
+	 */
+	if (_ep->name == ep0name && dum_hcd->udev &&
+			!test_bit(DUMMY_STOPPING, &dum_hcd->sched_flags))
+		tasklet_schedule(&dum_hcd->sched);
 	spin_unlock_irqrestore(&dum->lock, flags);
 
 	/* real hardware would likely enable transfers here, in case
@@ -779,7 +941,7 @@ static int dummy_dequeue(struct usb_ep *_ep, struct usb_request *_req)
 	spin_lock(&dum->lock);
 	list_for_each_entry(req, &ep->queue, queue) {
 		if (&req->req == _req) {
-			list_del_init(&req->queue);
+			dummy_unlink_request(req);
 			_req->status = -ECONNRESET;
 			retval = 0;
 			break;
@@ -1048,34 +1210,893 @@ static void init_dummy_udc_hw(struct dummy *dum)
 	int i;
 
 	INIT_LIST_HEAD(&dum->gadget.ep_list);
-	for (i = 0; i < DUMMY_ENDPOINTS; i++) {
+	for (i = 0; i < dum->num_eps; i++) {
 		struct dummy_ep	*ep = &dum->ep[i];
 
-		if (!ep_info[i].name)
-			break;
-		ep->ep.name = ep_info[i].name;
-		ep->ep.caps = ep_info[i].caps;
+		ep->ep.name = i ? dum->ep_cfg[i].name : ep0name;
+		ep->ep.caps = dum->ep_cfg[i].caps;
 		ep->ep.ops = &dummy_ep_ops;
 		list_add_tail(&ep->ep.ep_list, &dum->gadget.ep_list);
 		ep->halted = ep->wedged = ep->already_seen =
-				ep->setup_stage = 0;
-		usb_ep_set_maxpacket_limit(&ep->ep, ~0);
-		ep->ep.max_streams = 16;
+				ep->setup_stage = ep->stream_en = 0;
+		usb_ep_set_maxpacket_limit(&ep->ep,
+				dum->ep_cfg[i].maxpacket_limit);
+		ep->ep.max_streams = ilog2(DUMMY_MAX_STREAMS);
 		ep->last_io = jiffies;
 		ep->gadget = &dum->gadget;
 		ep->desc = NULL;
+		ep->burst = 1;
 		INIT_LIST_HEAD(&ep->queue);
+		INIT_LIST_HEAD(&ep->nostream.queue);
+		ep->streams = &ep->nostream;
+		ep->num_streams = 0;
 	}
 
 	dum->gadget.ep0 = &dum->ep[0].ep;
 	list_del_init(&dum->ep[0].ep.ep_list);
 	INIT_LIST_HEAD(&dum->fifo_req.queue);
+	INIT_LIST_HEAD(&dum->fifo_req.stream_queue);
 
 #ifdef CONFIG_USB_OTG
 	dum->gadget.is_otg = 1;
 #endif
 }
 
+/*-------------------------------------------------------------------------*/
+
+#ifdef CONFIG_DEBUG_FS
+
+/*
+ * Loopback self-test.  Writing to <debugfs>/dummy_hcd/<udc>/selftest binds
+ * a small source/sink gadget to that (otherwise unused) instance, waits for
+ * usbcore to configure it and then drives it from the host side, measuring
+ * the emulated link alone.  The gadget has a bulk IN source, a bulk OUT
+ * sink and an interrupt IN source; vendor requests 0x5b/0x5c write/read
+ * ep0 data and 0x5d sets the IN transfer length.  Accepted commands:
+ *
+ *	<bulk-in|bulk-out|int-in|ctrl-in|ctrl-out> <size> [<count>]
+ *	all [<count>]
+ *
+ * Reading the file returns the report of the last run.
+ */
+
+#define SELFTEST_VENDOR		0x1d6b	/* Linux Foundation */
+#define SELFTEST_PRODUCT	0x01fe	/* not claimed by any host driver */
+#define SELFTEST_BUFLEN		65536
+#define SELFTEST_CTRL_MAX	4096
+#define SELFTEST_QLEN		2
+#define SELFTEST_TIMEOUT	5000	/* ms */
+#define SELFTEST_COUNT		100
+
+#define SELFTEST_REQ_WRITE	0x5b
+#define SELFTEST_REQ_READ	0x5c
+#define SELFTEST_REQ_IN_LEN	0x5d
+
+enum selftest_type {
+	SELFTEST_BULK_IN,
+	SELFTEST_BULK_OUT,
+	SELFTEST_INT_IN,
+	SELFTEST_CTRL_IN,
+	SELFTEST_CTRL_OUT,
+};
+
+static const char *const selftest_names[] = {
+	[SELFTEST_BULK_IN]	= "bulk-in",
+	[SELFTEST_BULK_OUT]	= "bulk-out",
+	[SELFTEST_INT_IN]	= "int-in",
+	[SELFTEST_CTRL_IN]	= "ctrl-in",
+	[SELFTEST_CTRL_OUT]	= "ctrl-out",
+};
+
+static const unsigned selftest_sizes[] = { 64, 512, 4096, 16384, 65536 };
+
+static struct dentry *dummy_debugfs_root;
+
+struct selftest {
+	struct dummy			*dum;
+	struct usb_gadget_driver	driver;
+	struct usb_gadget		*gadget;
+	struct completion		configured;
+
+	struct usb_request		*ep0_req;
+	struct usb_ep			*in, *out, *int_in;
+	struct usb_request		*in_req[SELFTEST_QLEN];
+	struct usb_request		*out_req[SELFTEST_QLEN];
+	struct usb_request		*int_req[SELFTEST_QLEN];
+	struct usb_endpoint_descriptor	in_desc, out_desc, int_desc;
+	struct usb_ss_ep_comp_descriptor in_comp, out_comp, int_comp;
+	unsigned			in_len;
+	unsigned			next_in_len;	/* see ep0 completion */
+	bool				enabled;
+};
+
+/* gadget side */
+
+static void selftest_complete(struct usb_ep *ep, struct usb_request *req)
+{
+	/* keep the source and the sink going until dequeued */
+	if (req->status == 0)
+		usb_ep_queue(ep, req, GFP_ATOMIC);
+}
+
+static void selftest_set_speed(struct selftest *st,
+		enum usb_device_speed speed)
+{
+	unsigned	bulk, intr;
+	u8		interval;
+
+	switch (speed) {
+	case USB_SPEED_SUPER:
+		bulk = 1024;
+		intr = 1024;
+		interval = 4;
+		break;
+	case USB_SPEED_HIGH:
+		bulk = 512;
+		intr = 1024;
+		interval = 4;
+		break;
+	default:
+		bulk = 64;
+		intr = 64;
+		interval = 1;
+		break;
+	}
+	st->in_desc.wMaxPacketSize = cpu_to_le16(bulk);
+	st->out_desc.wMaxPacketSize = cpu_to_le16(bulk);
+	st->int_desc.wMaxPacketSize = cpu_to_le16(intr);
+	st->int_desc.bInterval = interval;
+	st->int_comp.wBytesPerInterval = cpu_to_le16(intr);
+}
+
+static void selftest_disable(struct selftest *st)
+{
+	if (!st->enabled)
+		return;
+	st->enabled = false;
+	usb_ep_disable(st->in);
+	usb_ep_disable(st->out);
+	usb_ep_disable(st->int_in);
+}
+
+static int selftest_enable_ep(struct selftest *st, struct usb_ep *ep,
+		struct usb_endpoint_descriptor *desc,
+		struct usb_ss_ep_comp_descriptor *comp,
+		struct usb_request **reqs, unsigned len)
+{
+	int	i, retval;
+
+	ep->desc = desc;
+	ep->comp_desc = st->gadget->speed == USB_SPEED_SUPER ? comp : NULL;
+	retval = usb_ep_enable(ep);
+	if (retval)
+		return retval;
+	for (i = 0; i < SELFTEST_QLEN; i++) {
+		reqs[i]->length = len;
+		retval = usb_ep_queue(ep, reqs[i], GFP_ATOMIC);
+		if (retval)
+			return retval;
+	}
+	return 0;
+}
+
+static int selftest_enable(struct selftest *st)
+{
+	int	retval;
+
+	selftest_disable(st);
+	selftest_set_speed(st, st->gadget->speed);
+	st->in_len = SELFTEST_BUFLEN;
+	retval = selftest_enable_ep(st, st->in, &st->in_desc, &st->in_comp,
+			st->in_req, st->in_len);
+	if (!retval)
+		retval = selftest_enable_ep(st, st->out, &st->out_desc,
+				&st->out_comp, st->out_req, SELFTEST_BUFLEN);
+	if (!retval)
+		retval = selftest_enable_ep(st, st->int_in, &st->int_desc,
+				&st->int_comp, st->int_req, st->in_len);
+	st->enabled = true;
+	if (retval)
+		selftest_disable(st);
+	return retval;
+}
+
+/* requeue the IN requests with a new length */
+static void selftest_set_in_len(struct selftest *st, unsigned len)
+{
+	int	i;
+
+	st->in_len = len;
+	for (i = 0; i < SELFTEST_QLEN; i++) {
+		usb_ep_dequeue(st->in, st->in_req[i]);
+		usb_ep_dequeue(st->int_in, st->int_req[i]);
+	}
+	for (i = 0; i < SELFTEST_QLEN; i++) {
+		st->in_req[i]->length = len;
+		usb_ep_queue(st->in, st->in_req[i], GFP_ATOMIC);
+		st->int_req[i]->length = len;
+		usb_ep_queue(st->int_in, st->int_req[i], GFP_ATOMIC);
+	}
+}
+
+static void selftest_ep0_complete(struct usb_ep *ep, struct usb_request *req)
+{
+	struct selftest		*st = req->context;
+
+	/*
+	 * A new IN length is applied once its request completes rather than
+	 * from setup(), so the IN queues aren't touched while dummy_hcd is
+	 * in the middle of the callback.
+	 */
+	if (st->next_in_len && req->status == 0 && st->enabled)
+		selftest_set_in_len(st, st->next_in_len);
+	st->next_in_len = 0;
+}
+
+static int selftest_config_buf(struct selftest *st, u8 *buf)
+{
+	struct usb_config_descriptor	*config = (void *) buf;
+	struct usb_interface_descriptor	*intf;
+	bool				ss;
+	int				len;
+
+	ss = st->gadget->speed == USB_SPEED_SUPER;
+	selftest_set_speed(st, st->gadget->speed);
+
+	*config = (struct usb_config_descriptor) {
+		.bLength =		USB_DT_CONFIG_SIZE,
+		.bDescriptorType =	USB_DT_CONFIG,
+		.bNumInterfaces =	1,
+		.bConfigurationValue =	1,
+		.bmAttributes =		USB_CONFIG_ATT_ONE |
+					USB_CONFIG_ATT_SELFPOWER,
+	};
+	len = USB_DT_CONFIG_SIZE;
+
+	intf = (void *) (buf + len);
+	*intf = (struct usb_interface_descriptor) {
+		.bLength =		USB_DT_INTERFACE_SIZE,
+		.bDescriptorType =	USB_DT_INTERFACE,
+		.bNumEndpoints =	3,
+		.bInterfaceClass =	USB_CLASS_VENDOR_SPEC,
+	};
+	len += USB_DT_INTERFACE_SIZE;
+
+#define SELFTEST_EP(_desc, _comp) \
+	do { \
+		memcpy(buf + len, &st->_desc, USB_DT_ENDPOINT_SIZE); \
+		len += USB_DT_ENDPOINT_SIZE; \
+		if (ss) { \
+			memcpy(buf + len, &st->_comp, USB_DT_SS_EP_COMP_SIZE); \
+			len += USB_DT_SS_EP_COMP_SIZE; \
+		} \
+	} while (0)
+
+	SELFTEST_EP(in_desc, in_comp);
+	SELFTEST_EP(out_desc, out_comp);
+	SELFTEST_EP(int_desc, int_comp);
+#undef SELFTEST_EP
+
+	config->wTotalLength = cpu_to_le16(len);
+	return len;
+}
+
+static int selftest_bos_buf(u8 *buf)
+{
+	struct usb_bos_descriptor		*bos = (void *) buf;
+	struct usb_ext_cap_descriptor		*ext;
+	struct usb_ss_cap_descriptor		*ss;
+
+	ext = (void *) (buf + USB_DT_BOS_SIZE);
+	ss = (void *) (buf + USB_DT_BOS_SIZE + USB_DT_USB_EXT_CAP_SIZE);
+
+	*bos = (struct usb_bos_descriptor) {
+		.bLength =		USB_DT_BOS_SIZE,
+		.bDescriptorType =	USB_DT_BOS,
+		.wTotalLength =		cpu_to_le16(USB_DT_BOS_SIZE +
+					USB_DT_USB_EXT_CAP_SIZE +
+					USB_DT_USB_SS_CAP_SIZE),
+		.bNumDeviceCaps =	2,
+	};
+	*ext = (struct usb_ext_cap_descriptor) {
+		.bLength =		USB_DT_USB_EXT_CAP_SIZE,
+		.bDescriptorType =	USB_DT_DEVICE_CAPABILITY,
+		.bDevCapabilityType =	USB_CAP_TYPE_EXT,
+	};
+	*ss = (struct usb_ss_cap_descriptor) {
+		.bLength =		USB_DT_USB_SS_CAP_SIZE,
+		.bDescriptorType =	USB_DT_DEVICE_CAPABILITY,
+		.bDevCapabilityType =	USB_SS_CAP_TYPE,
+		.wSpeedSupported =	cpu_to_le16(USB_5GBPS_OPERATION),
+		.bFunctionalitySupport = USB_LOW_SPEED_OPERATION,
+	};
+	return le16_to_cpu(bos->wTotalLength);
+}
+
+static int selftest_setup(struct usb_gadget *gadget,
+		const struct usb_ctrlrequest *ctrl)
+{
+	struct selftest		*st = get_gadget_data(gadget);
+	struct usb_request	*req = st->ep0_req;
+	u16			w_value = le16_to_cpu(ctrl->wValue);
+	u16			w_index = le16_to_cpu(ctrl->wIndex);
+	u16			w_length = le16_to_cpu(ctrl->wLength);
+	u32			len;
+	int			value = -EOPNOTSUPP;
+
+	switch (ctrl->bRequest) {
+	case USB_REQ_GET_DESCRIPTOR:
+		if (ctrl->bRequestType != USB_DIR_IN)
+			break;
+		switch (w_value >> 8) {
+		case USB_DT_DEVICE: {
+			struct usb_device_descriptor	*dev = req->buf;
+
+			*dev = (struct usb_device_descriptor) {
+				.bLength =		USB_DT_DEVICE_SIZE,
+				.bDescriptorType =	USB_DT_DEVICE,
+				.bDeviceClass =		USB_CLASS_VENDOR_SPEC,
+				.idVendor =	cpu_to_le16(SELFTEST_VENDOR),
+				.idProduct =	cpu_to_le16(SELFTEST_PRODUCT),
+				.bNumConfigurations =	1,
+			};
+			if (gadget->speed == USB_SPEED_SUPER) {
+				dev->bcdUSB = cpu_to_le16(0x0300);
+				dev->bMaxPacketSize0 = 9;
+			} else {
+				dev->bcdUSB = cpu_to_le16(0x0200);
+				dev->bMaxPacketSize0 = 64;
+			}
+			value = USB_DT_DEVICE_SIZE;
+			break;
+		}
+		case USB_DT_CONFIG:
+			if ((w_value & 0xff) == 0)
+				value = selftest_config_buf(st, req->buf);
+			break;
+		case USB_DT_BOS:
+			if (gadget->speed == USB_SPEED_SUPER)
+				value = selftest_bos_buf(req->buf);
+			break;
+		}
+		break;
+	case USB_REQ_SET_CONFIGURATION:
+		if (ctrl->bRequestType != 0)
+			break;
+		if (w_value == 1) {
+			value = selftest_enable(st);
+			if (!value)
+				complete(&st->configured);
+		} else if (w_value == 0) {
+			selftest_disable(st);
+			value = 0;
+		}
+		break;
+	case USB_REQ_SET_INTERFACE:
+		if (ctrl->bRequestType == USB_RECIP_INTERFACE && !w_value &&
+				!w_index)
+			value = 0;
+		break;
+	case SELFTEST_REQ_WRITE:
+	case SELFTEST_REQ_READ:
+		if ((ctrl->bRequestType & USB_TYPE_MASK) != USB_TYPE_VENDOR)
+			break;
+		if (w_length > SELFTEST_CTRL_MAX)
+			break;
+		value = w_length;
+		break;
+	case SELFTEST_REQ_IN_LEN:
+		if (ctrl->bRequestType != (USB_TYPE_VENDOR | USB_RECIP_DEVICE)
+				|| w_length || !st->enabled)
+			break;
+		len = w_value | ((u32) w_index << 16);
+		if (len < 1 || len > SELFTEST_BUFLEN) {
+			value = -EINVAL;
+			break;
+		}
+		st->next_in_len = len;
+		value = 0;
+		break;
+	}
+
+	if (value < 0)
+		return value;
+
+	req->length = min_t(unsigned, value, w_length);
+	req->zero = value < w_length;
+	value = usb_ep_queue(gadget->ep0, req, GFP_ATOMIC);
+	if (value < 0)
+		dev_err(&gadget->dev, "selftest ep0 queue error %d\n", value);
+	return value;
+}
+
+static void selftest_disconnect(struct usb_gadget *gadget)
+{
+	selftest_disable(get_gadget_data(gadget));
+}
+
+/*
+ * Like usb_ep_autoconfig(), without depending on libcomposite.  Fixed
+ * function endpoints get the number from their name, configurable ones
+ * are numbered later by selftest_number_eps().
+ */
+static struct usb_ep *selftest_match_ep(struct usb_gadget *gadget,
+		struct usb_endpoint_descriptor *desc,
+		struct usb_ss_ep_comp_descriptor *comp)
+{
+	struct usb_ep	*ep;
+
+	gadget_for_each_ep(ep, gadget) {
+		if (!usb_gadget_ep_match_desc(gadget, ep, desc,
+				gadget_is_superspeed(gadget) ? comp : NULL))
+			continue;
+		if (isdigit(ep->name[2]))
+			desc->bEndpointAddress |=
+				simple_strtoul(ep->name + 2, NULL, 10);
+		ep->claimed = true;
+		return ep;
+	}
+	return NULL;
+}
+
+static void selftest_number_eps(struct selftest *st)
+{
+	struct usb_endpoint_descriptor	*descs[] = {
+		&st->in_desc, &st->out_desc, &st->int_desc,
+	};
+	int				i, j;
+	u8				num = 1;
+
+	for (i = 0; i < ARRAY_SIZE(descs); i++) {
+		if (usb_endpoint_num(descs[i]))
+			continue;
+retry:
+		for (j = 0; j < ARRAY_SIZE(descs); j++) {
+			if (usb_endpoint_num(descs[j]) == num) {
+				num++;
+				goto retry;
+			}
+		}
+		descs[i]->bEndpointAddress |= num++;
+	}
+}
+
+static int selftest_alloc_reqs(struct usb_ep *ep, struct usb_request **reqs)
+{
+	int	i;
+
+	for (i = 0; i < SELFTEST_QLEN; i++) {
+		reqs[i] = usb_ep_alloc_request(ep, GFP_KERNEL);
+		if (!reqs[i])
+			return -ENOMEM;
+		reqs[i]->buf = kzalloc(SELFTEST_BUFLEN, GFP_KERNEL);
+		if (!reqs[i]->buf)
+			return -ENOMEM;
+		reqs[i]->complete = selftest_complete;
+	}
+	return 0;
+}
+
+static void selftest_free_reqs(struct usb_ep *ep, struct usb_request **reqs)
+{
+	int	i;
+
+	for (i = 0; i < SELFTEST_QLEN; i++) {
+		if (!reqs[i])
+			continue;
+		kfree(reqs[i]->buf);
+		usb_ep_free_request(ep, reqs[i]);
+		reqs[i] = NULL;
+	}
+}
+
+static void selftest_unbind(struct usb_gadget *gadget)
+{
+	struct selftest		*st = get_gadget_data(gadget);
+	struct usb_ep		*ep;
+
+	selftest_disable(st);
+	if (st->in)
+		selftest_free_reqs(st->in, st->in_req);
+	if (st->out)
+		selftest_free_reqs(st->out, st->out_req);
+	if (st->int_in)
+		selftest_free_reqs(st->int_in, st->int_req);
+	if (st->ep0_req) {
+		kfree(st->ep0_req->buf);
+		usb_ep_free_request(gadget->ep0, st->ep0_req);
+		st->ep0_req = NULL;
+	}
+	gadget_for_each_ep(ep, gadget)
+		ep->claimed = false;
+	set_gadget_data(gadget, NULL);
+}
+
+static int selftest_bind(struct usb_gadget *gadget,
+		struct usb_gadget_driver *driver)
+{
+	struct selftest		*st = container_of(driver, struct selftest,
+						driver);
+	int			retval;
+
+	st->gadget = gadget;
+	set_gadget_data(gadget, st);
+
+	/* match with the largest packets the gadget may have to use */
+	st->in_desc = st->out_desc = st->int_desc =
+			(struct usb_endpoint_descriptor) {
+		.bLength =		USB_DT_ENDPOINT_SIZE,
+		.bDescriptorType =	USB_DT_ENDPOINT,
+		.bmAttributes =		USB_ENDPOINT_XFER_BULK,
+	};
+	st->in_desc.bEndpointAddress = USB_DIR_IN;
+	st->out_desc.bEndpointAddress = USB_DIR_OUT;
+	st->int_desc.bEndpointAddress = USB_DIR_IN;
+	st->int_desc.bmAttributes = USB_ENDPOINT_XFER_INT;
+	st->in_comp = st->out_comp = st->int_comp =
+			(struct usb_ss_ep_comp_descriptor) {
+		.bLength =		USB_DT_SS_EP_COMP_SIZE,
+		.bDescriptorType =	USB_DT_SS_ENDPOINT_COMP,
+	};
+	selftest_set_speed(st, gadget->max_speed);
+
+	st->in = selftest_match_ep(gadget, &st->in_desc, &st->in_comp);
+	st->out = selftest_match_ep(gadget, &st->out_desc, &st->out_comp);
+	st->int_in = selftest_match_ep(gadget, &st->int_desc, &st->int_comp);
+	if (!st->in || !st->out || !st->int_in) {
+		dev_err(&gadget->dev, "selftest: no suitable endpoints\n");
+		retval = -ENODEV;
+		goto err;
+	}
+	selftest_number_eps(st);
+
+	retval = -ENOMEM;
+	st->ep0_req = usb_ep_alloc_request(gadget->ep0, GFP_KERNEL);
+	if (!st->ep0_req)
+		goto err;
+	st->ep0_req->buf = kzalloc(SELFTEST_CTRL_MAX, GFP_KERNEL);
+	if (!st->ep0_req->buf)
+		goto err;
+	st->ep0_req->complete = selftest_ep0_complete;
+	st->ep0_req->context = st;
+
+	retval = selftest_alloc_reqs(st->in, st->in_req);
+	if (!retval)
+		retval = selftest_alloc_reqs(st->out, st->out_req);
+	if (!retval)
+		retval = selftest_alloc_reqs(st->int_in, st->int_req);
+	if (retval)
+		goto err;
+	return 0;
+
+err:
+	selftest_unbind(gadget);
+	return retval;
+}
+
+/* host side */
+
+static struct usb_device *selftest_find_udev(struct dummy *dum)
+{
+	struct dummy_hcd	*hcds[] = { dum->hs_hcd, dum->ss_hcd };
+	struct usb_device	*udev = NULL;
+	int			i;
+
+	for (i = 0; i < ARRAY_SIZE(hcds) && !udev; i++) {
+		struct usb_device	*root;
+
+		if (!hcds[i])
+			continue;
+		root = dummy_hcd_to_hcd(hcds[i])->self.root_hub;
+		usb_lock_device(root);
+		udev = usb_hub_find_child(root, 1);
+		if (udev && udev->actconfig &&
+				le16_to_cpu(udev->descriptor.idVendor) ==
+					SELFTEST_VENDOR &&
+				le16_to_cpu(udev->descriptor.idProduct) ==
+					SELFTEST_PRODUCT)
+			usb_get_dev(udev);
+		else
+			udev = NULL;
+		usb_unlock_device(root);
+	}
+	return udev;
+}
+
+static int selftest_xfer(struct selftest *st, struct usb_device *udev,
+		enum selftest_type type, void *buf, unsigned size)
+{
+	int	actual = 0;
+	int	retval;
+
+	switch (type) {
+	case SELFTEST_BULK_IN:
+		retval = usb_bulk_msg(udev, usb_rcvbulkpipe(udev,
+				usb_endpoint_num(&st->in_desc)),
+				buf, size, &actual, SELFTEST_TIMEOUT);
+		break;
+	case SELFTEST_BULK_OUT:
+		retval = usb_bulk_msg(udev, usb_sndbulkpipe(udev,
+				usb_endpoint_num(&st->out_desc)),
+				buf, size, &actual, SELFTEST_TIMEOUT);
+		break;
+	case SELFTEST_INT_IN:
+		retval = usb_interrupt_msg(udev, usb_rcvintpipe(udev,
+				usb_endpoint_num(&st->int_desc)),
+				buf, size, &actual, SELFTEST_TIMEOUT);
+		break;
+	case SELFTEST_CTRL_IN:
+		retval = usb_control_msg(udev, usb_rcvctrlpipe(udev, 0),
+				SELFTEST_REQ_READ,
+				USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+				0, 0, buf, size, SELFTEST_TIMEOUT);
+		actual = retval;
+		break;
+	default:
+		retval = usb_control_msg(udev, usb_sndctrlpipe(udev, 0),
+				SELFTEST_REQ_WRITE,
+				USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+				0, 0, buf, size, SELFTEST_TIMEOUT);
+		actual = retval;
+		break;
+	}
+	if (retval < 0)
+		return retval;
+	return actual == size ? 0 : -EREMOTEIO;
+}
+
+static int selftest_run(struct selftest *st, struct usb_device *udev,
+		enum selftest_type type, unsigned size, unsigned count,
+		void *buf, char *report, size_t len)
+{
+	u64		total = 0, min = U64_MAX, max = 0, bytes, rate;
+	u32		frac;
+	unsigned	i;
+	int		retval = 0;
+
+	if (type == SELFTEST_BULK_IN || type == SELFTEST_INT_IN) {
+		retval = usb_control_msg(udev, usb_sndctrlpipe(udev, 0),
+				SELFTEST_REQ_IN_LEN,
+				USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+				size & 0xffff, size >> 16, NULL, 0,
+				SELFTEST_TIMEOUT);
+		if (retval < 0)
+			goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		ktime_t		start = ktime_get();
+		u64		ns;
+
+		retval = selftest_xfer(st, udev, type, buf, size);
+		if (retval < 0)
+			goto out;
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		total += ns;
+		min = min(min, ns);
+		max = max(max, ns);
+	}
+
+out:
+	if (retval < 0)
+		return scnprintf(report, len, "%-8s %6u: failed at %u/%u: %d\n",
+				selftest_names[type], size, i, count, retval);
+
+	bytes = (u64) size * count;
+	total = max_t(u64, total, 1);
+	rate = div64_u64(bytes * 100000, total);	/* 10 KB/s units */
+	frac = do_div(rate, 100);
+	return scnprintf(report, len,
+			"%-8s %6u: %u xfers in %llu us, %llu.%02u MB/s, "
+			"%llu xfers/s, latency avg %llu min %llu max %llu us\n",
+			selftest_names[type], size, count,
+			div_u64(total, NSEC_PER_USEC),
+			rate, frac,
+			div64_u64((u64) count * NSEC_PER_SEC, total),
+			div_u64(div_u64(total, count), NSEC_PER_USEC),
+			div_u64(min, NSEC_PER_USEC),
+			div_u64(max, NSEC_PER_USEC));
+}
+
+static unsigned selftest_max_size(enum selftest_type type)
+{
+	if (type == SELFTEST_CTRL_IN || type == SELFTEST_CTRL_OUT)
+		return SELFTEST_CTRL_MAX;
+	return SELFTEST_BUFLEN;
+}
+
+static int dummy_selftest(struct dummy *dum, int type, unsigned size,
+		unsigned count)
+{
+	struct selftest		*st;
+	struct usb_device	*udev = NULL;
+	size_t			len = 0;
+	char			*report = dum->selftest_report;
+	void			*buf;
+	int			retval, i, j;
+
+	spin_lock_irq(&dum->lock);
+	retval = dum->driver ? -EBUSY : 0;
+	spin_unlock_irq(&dum->lock);
+	if (retval)
+		return retval;
+
+	st = kzalloc(sizeof(*st), GFP_KERNEL);
+	buf = kzalloc(SELFTEST_BUFLEN, GFP_KERNEL);
+	if (!st || !buf) {
+		retval = -ENOMEM;
+		goto out_free;
+	}
+	st->dum = dum;
+	init_completion(&st->configured);
+	st->driver.function = "dummy_hcd selftest";
+	st->driver.max_speed = dum->gadget.max_speed;
+	st->driver.bind = selftest_bind;
+	st->driver.unbind = selftest_unbind;
+	st->driver.setup = selftest_setup;
+	st->driver.disconnect = selftest_disconnect;
+	st->driver.reset = selftest_disconnect;
+	st->driver.driver.name = "dummy_selftest";
+	st->driver.udc_name = (char *) dev_name(dum->gadget.dev.parent);
+	st->driver.match_existing_only = 1;
+
+	retval = usb_gadget_probe_driver(&st->driver);
+	if (retval)
+		goto out_free;
+
+	/* the gadget is configured before usbcore installs the config */
+	if (!wait_for_completion_timeout(&st->configured,
+			msecs_to_jiffies(SELFTEST_TIMEOUT))) {
+		retval = -ETIMEDOUT;
+		goto out_unregister;
+	}
+	for (i = 0; i < SELFTEST_TIMEOUT / 20; i++) {
+		udev = selftest_find_udev(dum);
+		if (udev)
+			break;
+		msleep(20);
+	}
+	if (!udev) {
+		retval = -ENODEV;
+		goto out_unregister;
+	}
+
+	len += scnprintf(report + len, PAGE_SIZE - len, "speed %s\n",
+			usb_speed_string(udev->speed));
+	for (i = 0; i < ARRAY_SIZE(selftest_names); i++) {
+		if (type >= 0 && i != type)
+			continue;
+		for (j = 0; j < ARRAY_SIZE(selftest_sizes); j++) {
+			unsigned	sz = size ? size : selftest_sizes[j];
+
+			if (sz > selftest_max_size(i))
+				break;
+			len += selftest_run(st, udev, i, sz, count, buf,
+					report + len, PAGE_SIZE - len);
+			if (size)
+				break;
+		}
+	}
+	dum->selftest_len = len;
+
+	usb_put_dev(udev);
+out_unregister:
+	usb_gadget_unregister_driver(&st->driver);
+out_free:
+	kfree(buf);
+	kfree(st);
+	return retval;
+}
+
+static ssize_t selftest_read(struct file *file, char __user *ubuf,
+		size_t count, loff_t *ppos)
+{
+	struct dummy	*dum = file->private_data;
+	ssize_t		retval;
+
+	mutex_lock(&dum->selftest_mutex);
+	retval = simple_read_from_buffer(ubuf, count, ppos,
+			dum->selftest_report, dum->selftest_len);
+	mutex_unlock(&dum->selftest_mutex);
+	return retval;
+}
+
+static ssize_t selftest_write(struct file *file, const char __user *ubuf,
+		size_t count, loff_t *ppos)
+{
+	struct dummy	*dum = file->private_data;
+	char		cmd[64], name[16];
+	unsigned	size = 0, nr = SELFTEST_COUNT;
+	int		type = -1;
+	int		retval;
+
+	if (count >= sizeof(cmd))
+		return -EINVAL;
+	if (copy_from_user(cmd, ubuf, count))
+		return -EFAULT;
+	cmd[count] = '\0';
+
+	if (sscanf(cmd, "%15s", name) != 1)
+		return -EINVAL;
+	if (!strcmp(name, "all")) {
+		if (sscanf(cmd, "%15s %u", name, &nr) < 1)
+			return -EINVAL;
+	} else {
+		type = match_string(selftest_names,
+				ARRAY_SIZE(selftest_names), name);
+		if (type < 0)
+			return -EINVAL;
+		if (sscanf(cmd, "%15s %u %u", name, &size, &nr) < 2 || !size ||
+				size > selftest_max_size(type))
+			return -EINVAL;
+	}
+	if (!nr)
+		return -EINVAL;
+
+	mutex_lock(&dum->selftest_mutex);
+	dum->selftest_len = 0;
+	retval = dummy_selftest(dum, type, size, nr);
+	mutex_unlock(&dum->selftest_mutex);
+	return retval ? retval : count;
+}
+
+static const struct file_operations selftest_fops = {
+	.owner =	THIS_MODULE,
+	.open =		simple_open,
+	.read =		selftest_read,
+	.write =	selftest_write,
+	.llseek =	default_llseek,
+};
+
+static int dummy_selftest_init(struct dummy *dum, struct device *dev)
+{
+	mutex_init(&dum->selftest_mutex);
+	dum->selftest_report = (char *) get_zeroed_page(GFP_KERNEL);
+	if (!dum->selftest_report)
+		return -ENOMEM;
+	dum->debugfs = debugfs_create_dir(dev_name(dev), dummy_debugfs_root);
+	debugfs_create_file("selftest", 0600, dum->debugfs, dum,
+			&selftest_fops);
+	return 0;
+}
+
+static void dummy_selftest_exit(struct dummy *dum)
+{
+	debugfs_remove_recursive(dum->debugfs);
+	free_page((unsigned long) dum->selftest_report);
+}
+
+static void dummy_debugfs_init(void)
+{
+	dummy_debugfs_root = debugfs_create_dir(driver_name, usb_debug_root);
+}
+
+static void dummy_debugfs_exit(void)
+{
+	debugfs_remove_recursive(dummy_debugfs_root);
+}
+
+#else
+
+static inline int dummy_selftest_init(struct dummy *dum, struct device *dev)
+{
+	return 0;
+}
+
+static inline void dummy_selftest_exit(struct dummy *dum)
+{
+}
+
+static inline void dummy_debugfs_init(void)
+{
+}
+
+static inline void dummy_debugfs_exit(void)
+{
+}
+
+#endif	/* CONFIG_DEBUG_FS */
+
 static int dummy_udc_probe(struct platform_device *pdev)
 {
 	struct dummy	*dum;
@@ -1103,9 +2124,14 @@ static int dummy_udc_probe(struct platform_device *pdev)
 	rc = device_create_file(&dum->gadget.dev, &dev_attr_function);
 	if (rc < 0)
 		goto err_dev;
+	rc = dummy_selftest_init(dum, &pdev->dev);
+	if (rc < 0)
+		goto err_selftest;
 	platform_set_drvdata(pdev, dum);
 	return rc;
 
+err_selftest:
+	device_remove_file(&dum->gadget.dev, &dev_attr_function);
 err_dev:
 	usb_del_gadget_udc(&dum->gadget);
 err_udc:
@@ -1116,6 +2142,7 @@ static int dummy_udc_remove(struct platform_device *pdev)
 {
 	struct dummy	*dum = platform_get_drvdata(pdev);
 
+	dummy_selftest_exit(dum);
 	device_remove_file(&dum->gadget.dev, &dev_attr_function);
 	usb_del_gadget_udc(&dum->gadget);
 	return 0;
@@ -1199,41 +2226,26 @@ static int dummy_ep_stream_en(struct dummy_hcd *dum_hcd, struct urb *urb)
 }
 
 /*
- * The max stream number is saved as a nibble so for the 30 possible endpoints
- * we only 15 bytes of memory. Therefore we are limited to max 16 streams (0
- * means we use only 1 stream). The maximum according to the spec is 16bit so
- * if the 16 stream limit is about to go, the array size should be incremented
- * to 30 elements of type u16.
+ * The max stream number is kept per endpoint index (see dummy_get_ep_idx()),
+ * and is capped at DUMMY_MAX_STREAMS so that the gadget side can index its
+ * per-stream request queues directly by stream ID.
  */
 static int get_max_streams_for_pipe(struct dummy_hcd *dum_hcd,
 		unsigned int pipe)
 {
-	int max_streams;
+	unsigned int index;
 
-	max_streams = dum_hcd->num_stream[usb_pipeendpoint(pipe)];
-	if (usb_pipeout(pipe))
-		max_streams >>= 4;
-	else
-		max_streams &= 0xf;
-	max_streams++;
-	return max_streams;
+	index = usb_pipeendpoint(pipe) << 1;
+	if (usb_pipein(pipe))
+		index |= 1;
+	return dum_hcd->num_stream[index];
 }
 
-static void set_max_streams_for_pipe(struct dummy_hcd *dum_hcd,
-		unsigned int pipe, unsigned int streams)
+static void set_max_streams_for_ep(struct dummy_hcd *dum_hcd,
+		const struct usb_endpoint_descriptor *desc,
+		unsigned int streams)
 {
-	int max_streams;
-
-	streams--;
-	max_streams = dum_hcd->num_stream[usb_pipeendpoint(pipe)];
-	if (usb_pipeout(pipe)) {
-		streams <<= 4;
-		max_streams &= 0xf;
-	} else {
-		max_streams &= 0xf0;
-	}
-	max_streams |= streams;
-	dum_hcd->num_stream[usb_pipeendpoint(pipe)] = max_streams;
+	dum_hcd->num_stream[dummy_get_ep_idx(desc)] = streams;
 }
 
 static int dummy_validate_stream(struct dummy_hcd *dum_hcd, struct urb *urb)
@@ -1250,8 +2262,7 @@ static int dummy_validate_stream(struct dummy_hcd *dum_hcd, struct urb *urb)
 	if (!enabled)
 		return -EINVAL;
 
-	max_streams = get_max_streams_for_pipe(dum_hcd,
-			usb_pipeendpoint(urb->pipe));
+	max_streams = get_max_streams_for_pipe(dum_hcd, urb->pipe);
 	if (urb->stream_id > max_streams) {
 		dev_err(dummy_dev(dum_hcd), "Stream id %d is out of range.\n",
 				urb->stream_id);
@@ -1406,20 +2417,36 @@ static int transfer(struct dummy_hcd *dum_hcd, struct urb *urb,
 {
 	struct dummy		*dum = dum_hcd->dum;
 	struct dummy_request	*req;
+	struct dummy_stream	*stream;
+	unsigned		burst_len;
 	int			sent = 0;
 
+	/* SuperSpeed bursts are the unit of scheduling; one packet otherwise */
+	burst_len = ep->ep.maxpacket * ep->burst;
+
 top:
+	/*
+	 * A host that didn't allocate streams uses stream 0, which works
+	 * with the gadget either way.  Stream IDs from the host can't match
+	 * any request of a gadget endpoint without streams though, so fail
+	 * the URB instead of NAKing it forever.  Look the stream up again
+	 * after every giveback, since the completion handler may have
+	 * disabled the endpoint and freed its streams.
+	 */
+	if (dummy_ep_stream_en(dum_hcd, urb) && !ep->stream_en) {
+		*status = -EPROTO;
+		return sent;
+	}
+	stream = dummy_ep_stream(ep, urb->stream_id);
+	if (!stream)
+		return sent;
+
 	/* if there's no request queued, the device is NAKing; return */
-	list_for_each_entry(req, &ep->queue, queue) {
+	list_for_each_entry(req, &stream->queue, stream_queue) {
 		unsigned	host_len, dev_len, len;
 		int		is_short, to_host;
 		int		rescan = 0;
 
-		if (dummy_ep_stream_en(dum_hcd, urb)) {
-			if ((urb->stream_id != req->req.stream_id))
-				continue;
-		}
-
 		/* 1..N packets of ep->ep.maxpacket each ... the last one
 		 * may be short (including zero length).
 		 *
@@ -1437,8 +2464,8 @@ top:
 		if (unlikely(len == 0))
 			is_short = 1;
 		else {
-			/* not enough bandwidth left? */
-			if (limit < ep->ep.maxpacket && limit < len)
+			/* not enough bandwidth left for a whole burst? */
+			if (limit < burst_len && limit < len)
 				break;
 			len = min_t(unsigned, len, limit);
 			if (len == 0)
@@ -1514,7 +2541,7 @@ top:
 
 		/* device side completion --> continuable */
 		if (req->req.status != -EINPROGRESS) {
-			list_del_init(&req->queue);
+			dummy_unlink_request(req);
 
 			spin_unlock(&dum->lock);
 			usb_gadget_giveback_request(&ep->ep, &req->req);
@@ -1548,14 +2575,19 @@ static int periodic_bytes(struct dummy *dum, struct dummy_ep *ep)
 		limit += limit * tmp;
 	}
 	if (dum->gadget.speed == USB_SPEED_SUPER) {
+		/* per service interval, follow the companion descriptor */
+		limit *= ep->burst;
 		switch (usb_endpoint_type(ep->desc)) {
 		case USB_ENDPOINT_XFER_ISOC:
 			/* Sec. 4.4.8.2 USB3.0 Spec */
-			limit = 3 * 16 * 1024 * 8;
+			if (ep->ep.comp_desc)
+				limit *= USB_SS_MULT(
+					ep->ep.comp_desc->bmAttributes);
+			limit *= 8 /* applies to entire frame */;
 			break;
 		case USB_ENDPOINT_XFER_INT:
 			/* Sec. 4.4.7.2 USB3.0 Spec */
-			limit = 3 * 1024 * 8;
+			limit *= 8 /* applies to entire frame */;
 			break;
 		case USB_ENDPOINT_XFER_BULK:
 		default:
@@ -1581,7 +2613,7 @@ static struct dummy_ep *find_endpoint(struct dummy *dum, u8 address)
 		return NULL;
 	if ((address & ~USB_DIR_IN) == 0)
 		return &dum->ep[0];
-	for (i = 1; i < DUMMY_ENDPOINTS; i++) {
+	for (i = 1; i < dum->num_eps; i++) {
 		struct dummy_ep	*ep = &dum->ep[i];
 
 		if (!ep->desc)
@@ -1777,19 +2809,52 @@ static int handle_control_request(struct dummy_hcd *dum_hcd, struct urb *urb,
 	return ret_val;
 }
 
+/*
+ * Clears the already_seen bits before each pass, and the counted bits
+ * once per scheduler run; caller must hold lock.
+ */
+static void dummy_clear_seen(struct dummy *dum, bool counted)
+{
+	int i, j;
+
+	for (i = 0; i < dum->num_eps; i++) {
+		struct dummy_ep		*ep = &dum->ep[i];
+
+		ep->already_seen = 0;
+		if (counted)
+			ep->counted = 0;
+		for (j = 0; ep->stream_en && j <= ep->num_streams; j++) {
+			ep->streams[j].already_seen = 0;
+			if (counted)
+				ep->streams[j].counted = 0;
+		}
+	}
+}
+
 /*
  * Drive both sides of the transfers; looks like irq handlers to both
  * drivers except that the callbacks are invoked from soft interrupt
  * context.
+ *
+ * This runs once per frame from the timer, and in between whenever the
+ * gadget queues an ep0 response ("kicks").  Kicks only serve ep0, so they
+ * don't hand out extra bandwidth; running both from one tasklet keeps
+ * them from overlapping.
  */
-static void dummy_timer(struct timer_list *t)
+static void dummy_schedule(unsigned long data)
 {
-	struct dummy_hcd	*dum_hcd = from_timer(dum_hcd, t, timer);
+	struct dummy_hcd	*dum_hcd = (struct dummy_hcd *) data;
 	struct dummy		*dum = dum_hcd->dum;
 	struct urbp		*urbp, *tmp;
 	unsigned long		flags;
 	int			limit, total;
-	int			i;
+	int			periodic_left, quantum;
+	enum dummy_sched_pass	pass;
+	unsigned		active = 0, round = 0;
+	bool			more = false;
+	bool			frame;
+
+	frame = test_and_clear_bit(DUMMY_FRAME_DUE, &dum_hcd->sched_flags);
 
 	/* simplistic model for one frame's bandwidth */
 	/* FIXME: account for transaction and packet overhead */
@@ -1813,24 +2878,36 @@ static void dummy_timer(struct timer_list *t)
 		break;
 	}
 
+	/*
+	 * Up to 80% of a high speed frame (90% otherwise) is reserved for
+	 * periodic transfers, see sec. 5.6.4 of the USB 2.0 spec.
+	 */
+	if (dum->gadget.speed == USB_SPEED_HIGH)
+		periodic_left = total / 10 * 8;
+	else
+		periodic_left = total / 10 * 9;
+
 	/* FIXME if HZ != 1000 this will probably misbehave ... */
 
 	/* look at each urb queued by the host side driver */
 	spin_lock_irqsave(&dum->lock, flags);
 
 	if (!dum_hcd->udev) {
-		dev_err(dummy_dev(dum_hcd),
-				"timer fired with no URBs pending?\n");
+		if (frame)
+			dev_err(dummy_dev(dum_hcd),
+					"timer fired with no URBs pending?\n");
 		spin_unlock_irqrestore(&dum->lock, flags);
 		return;
 	}
 	dum_hcd->next_frame_urbp = NULL;
+	if (frame)
+		dum_hcd->stats.frames++;
+	else
+		dum_hcd->stats.kicks++;
 
-	for (i = 0; i < DUMMY_ENDPOINTS; i++) {
-		if (!ep_info[i].name)
-			break;
-		dum->ep[i].already_seen = 0;
-	}
+	pass = frame ? DUMMY_PASS_PERIODIC : DUMMY_PASS_ASYNC_HI;
+	quantum = total / max(dum_hcd->rr_active, 1U);
+	dummy_clear_seen(dum, true);
 
 restart:
 	list_for_each_entry_safe(urbp, tmp, &dum_hcd->urbp_list, urbp_list) {
@@ -1838,7 +2915,9 @@ restart:
 		struct dummy_request	*req;
 		u8			address;
 		struct dummy_ep		*ep = NULL;
+		struct dummy_stream	*stream;
 		int			status = -EINPROGRESS;
+		int			sent;
 
 		/* stop when we reach URBs queued after the timer interrupt */
 		if (urbp == dum_hcd->next_frame_urbp)
@@ -1868,9 +2947,54 @@ restart:
 			goto return_urb;
 		}
 
-		if (ep->already_seen)
+		/* is it this endpoint's turn in the current pass? */
+		if (!frame) {
+			if (ep != &dum->ep[0])
+				continue;
+		} else if (pass == DUMMY_PASS_PERIODIC) {
+			if (!usb_pipeint(urb->pipe) &&
+					!usb_pipeisoc(urb->pipe))
+				continue;
+			if (periodic_left <= 0)
+				continue;
+		} else if (usb_pipeint(urb->pipe) || usb_pipeisoc(urb->pipe)) {
+			/* served by the periodic pass only */
 			continue;
-		ep->already_seen = 1;
+		} else if (((unsigned) (ep - dum->ep) >= dum_hcd->rr_cursor) !=
+				(pass == DUMMY_PASS_ASYNC_HI)) {
+			continue;
+		}
+
+		/*
+		 * URBs complete in order on each endpoint, or on each stream
+		 * of a stream-enabled one: a NAKing stream must not hold up
+		 * the others.
+		 */
+		if (ep->stream_en) {
+			stream = dummy_ep_stream(ep, urb->stream_id);
+			if (!stream || stream->already_seen)
+				continue;
+			stream->already_seen = 1;
+		} else {
+			if (ep->already_seen)
+				continue;
+			ep->already_seen = 1;
+		}
+
+		/*
+		 * Count each endpoint or stream once, even if several of its
+		 * URBs complete in the first round; already_seen is cleared
+		 * on every completion.
+		 */
+		if (pass != DUMMY_PASS_PERIODIC && !round) {
+			if (ep->stream_en && !stream->counted) {
+				stream->counted = 1;
+				active++;
+			} else if (!ep->stream_en && !ep->counted) {
+				ep->counted = 1;
+				active++;
+			}
+		}
 		if (ep == &dum->ep[0] && urb->error_count) {
 			ep->setup_stage = 1;	/* a new urb */
 			urb->error_count = 0;
@@ -1892,7 +3016,7 @@ restart:
 			setup = *(struct usb_ctrlrequest *) urb->setup_packet;
 			/* paranoia, in case of stale queued data */
 			list_for_each_entry(req, &ep->queue, queue) {
-				list_del_init(&req->queue);
+				dummy_unlink_request(req);
 				req->req.status = -EOVERFLOW;
 				dev_dbg(udc_dev(dum), "stale req = %p\n",
 						req);
@@ -1947,7 +3071,13 @@ restart:
 		}
 
 		/* non-control requests */
-		limit = total;
+		if (!frame)
+			limit = 64*1024;	/* ep0 data stage, see above */
+		else if (pass == DUMMY_PASS_PERIODIC)
+			limit = min(periodic_bytes(dum, ep), periodic_left);
+		else
+			limit = min_t(int, total, max_t(int, quantum,
+					ep->ep.maxpacket * ep->burst));
 		switch (usb_pipetype(urb->pipe)) {
 		case PIPE_ISOCHRONOUS:
 			/*
@@ -1959,7 +3089,6 @@ restart:
 			 * Complete whether or not ep has requests queued.
 			 * Report random errors, to debug drivers.
 			 */
-			limit = max(limit, periodic_bytes(dum, ep));
 			status = -EINVAL;	/* fail all xfers */
 			break;
 
@@ -1967,13 +3096,30 @@ restart:
 			/* FIXME is it urb->interval since the last xfer?
 			 * this almost certainly polls too fast.
 			 */
-			limit = max(limit, periodic_bytes(dum, ep));
 			fallthrough;
 
 		default:
 treat_control_like_bulk:
 			ep->last_io = jiffies;
-			total -= transfer(dum_hcd, urb, ep, limit, &status);
+			sent = transfer(dum_hcd, urb, ep, limit, &status);
+			total -= sent;
+			ep->sched_bytes += sent;
+			if (pass == DUMMY_PASS_PERIODIC) {
+				periodic_left -= sent;
+				dum_hcd->stats.periodic_bytes += sent;
+				break;
+			}
+			dum_hcd->stats.async_bytes += sent;
+
+			/* used up its turn, but wants more? */
+			if (sent && sent == limit && status == -EINPROGRESS)
+				more = true;
+			/* the next frame starts with the next endpoint */
+			if (total <= 0) {
+				dum_hcd->rr_cursor = (ep - dum->ep + 1) %
+						dum->num_eps;
+				dum_hcd->stats.saturated++;
+			}
 			break;
 		}
 
@@ -1984,8 +3130,12 @@ treat_control_like_bulk:
 return_urb:
 		list_del(&urbp->urbp_list);
 		kfree(urbp);
-		if (ep)
+		if (ep) {
 			ep->already_seen = ep->setup_stage = 0;
+			stream = dummy_ep_stream(ep, urb->stream_id);
+			if (ep->stream_en && stream)
+				stream->already_seen = 0;
+		}
 
 		usb_hcd_unlink_urb_from_ep(dummy_hcd_to_hcd(dum_hcd), urb);
 		spin_unlock(&dum->lock);
@@ -1995,17 +3145,62 @@ return_urb:
 		goto restart;
 	}
 
+	/* the frame timer is still pending after a kick */
+	if (!frame)
+		goto out;
+
+	/* on to the next pass, or another round if bandwidth is left */
+	if (pass == DUMMY_PASS_PERIODIC || pass == DUMMY_PASS_ASYNC_HI) {
+		pass++;
+		dummy_clear_seen(dum, false);
+		goto restart;
+	}
+	if (more && total > 0) {
+		dum_hcd->stats.rounds++;
+		round++;
+		more = false;
+		pass = DUMMY_PASS_ASYNC_HI;
+		quantum = total / max(active, 1U);
+		dummy_clear_seen(dum, false);
+		goto restart;
+	}
+	dum_hcd->rr_active = active;
+
 	if (list_empty(&dum_hcd->urbp_list)) {
 		usb_put_dev(dum_hcd->udev);
 		dum_hcd->udev = NULL;
-	} else if (dum_hcd->rh_state == DUMMY_RH_RUNNING) {
+	} else if (dum_hcd->rh_state == DUMMY_RH_RUNNING &&
+			!test_bit(DUMMY_STOPPING, &dum_hcd->sched_flags)) {
 		/* want a 1 msec delay here */
 		mod_timer(&dum_hcd->timer, jiffies + msecs_to_jiffies(1));
 	}
+	spin_unlock_irqrestore(&dum->lock, flags);
+	return;
 
+out:
+	if (list_empty(&dum_hcd->urbp_list)) {
+		/* nothing left for the frame the kick ran ahead of */
+		del_timer(&dum_hcd->timer);
+		usb_put_dev(dum_hcd->udev);
+		dum_hcd->udev = NULL;
+	} else if (dum_hcd->rh_state == DUMMY_RH_RUNNING &&
+			!test_bit(DUMMY_STOPPING, &dum_hcd->sched_flags) &&
+			!timer_pending(&dum_hcd->timer)) {
+		mod_timer(&dum_hcd->timer, jiffies + msecs_to_jiffies(1));
+	}
 	spin_unlock_irqrestore(&dum->lock, flags);
 }
 
+static void dummy_timer(struct timer_list *t)
+{
+	struct dummy_hcd	*dum_hcd = from_timer(dum_hcd, t, timer);
+
+	if (test_bit(DUMMY_STOPPING, &dum_hcd->sched_flags))
+		return;
+	set_bit(DUMMY_FRAME_DUE, &dum_hcd->sched_flags);
+	tasklet_schedule(&dum_hcd->sched);
+}
+
 /*-------------------------------------------------------------------------*/
 
 #define PORT_C_MASK \
@@ -2468,9 +3663,56 @@ static ssize_t urbs_show(struct device *dev, struct device_attribute *attr,
 }
 static DEVICE_ATTR_RO(urbs);
 
+static size_t show_sched(char *buf, size_t size, const char *name,
+		struct dummy_hcd *dum_hcd)
+{
+	const struct dummy_sched_stats	*stats = &dum_hcd->stats;
+
+	return scnprintf(buf, size,
+			"%s: frames %llu saturated %llu rounds %llu kicks %llu "
+			"periodic %llu async %llu cursor %u active %u\n",
+			name, stats->frames, stats->saturated, stats->rounds,
+			stats->kicks,
+			stats->periodic_bytes, stats->async_bytes,
+			dum_hcd->rr_cursor, dum_hcd->rr_active);
+}
+
+static ssize_t sched_show(struct device *dev, struct device_attribute *attr,
+		char *buf)
+{
+	struct usb_hcd		*hcd = dev_get_drvdata(dev);
+	struct dummy		*dum = hcd_to_dummy_hcd(hcd)->dum;
+	size_t			size = 0;
+	unsigned long		flags;
+	int			i;
+
+	spin_lock_irqsave(&dum->lock, flags);
+	if (dum->hs_hcd)
+		size += show_sched(buf + size, PAGE_SIZE - size, "hs",
+				dum->hs_hcd);
+	if (dum->ss_hcd)
+		size += show_sched(buf + size, PAGE_SIZE - size, "ss",
+				dum->ss_hcd);
+	for (i = 0; i < dum->num_eps; i++) {
+		struct dummy_ep		*ep = &dum->ep[i];
+
+		if (!ep->desc && i)
+			continue;
+		size += scnprintf(buf + size, PAGE_SIZE - size,
+				"%s: %llu bytes\n", ep->ep.name,
+				ep->sched_bytes);
+	}
+	spin_unlock_irqrestore(&dum->lock, flags);
+
+	return size;
+}
+static DEVICE_ATTR_RO(sched);
+
 static int dummy_start_ss(struct dummy_hcd *dum_hcd)
 {
 	timer_setup(&dum_hcd->timer, dummy_timer, 0);
+	tasklet_init(&dum_hcd->sched, dummy_schedule, (unsigned long) dum_hcd);
+	dum_hcd->sched_flags = 0;
 	dum_hcd->rh_state = DUMMY_RH_RUNNING;
 	dum_hcd->stream_en_ep = 0;
 	INIT_LIST_HEAD(&dum_hcd->urbp_list);
@@ -2489,6 +3731,7 @@ static int dummy_start_ss(struct dummy_hcd *dum_hcd)
 static int dummy_start(struct usb_hcd *hcd)
 {
 	struct dummy_hcd	*dum_hcd = hcd_to_dummy_hcd(hcd);
+	int			retval;
 
 	/*
 	 * HOST side init ... we emulate a root hub that'll only ever
@@ -2500,6 +3743,8 @@ static int dummy_start(struct usb_hcd *hcd)
 
 	spin_lock_init(&dum_hcd->dum->lock);
 	timer_setup(&dum_hcd->timer, dummy_timer, 0);
+	tasklet_init(&dum_hcd->sched, dummy_schedule, (unsigned long) dum_hcd);
+	dum_hcd->sched_flags = 0;
 	dum_hcd->rh_state = DUMMY_RH_RUNNING;
 
 	INIT_LIST_HEAD(&dum_hcd->urbp_list);
@@ -2513,11 +3758,32 @@ static int dummy_start(struct usb_hcd *hcd)
 #endif
 
 	/* FIXME 'urbs' should be a per-device thing, maybe in usbcore */
-	return device_create_file(dummy_dev(dum_hcd), &dev_attr_urbs);
+	retval = device_create_file(dummy_dev(dum_hcd), &dev_attr_urbs);
+	if (retval)
+		return retval;
+	retval = device_create_file(dummy_dev(dum_hcd), &dev_attr_sched);
+	if (retval)
+		device_remove_file(dummy_dev(dum_hcd), &dev_attr_urbs);
+	return retval;
 }
 
 static void dummy_stop(struct usb_hcd *hcd)
 {
+	struct dummy_hcd	*dum_hcd = hcd_to_dummy_hcd(hcd);
+
+	/*
+	 * The timer schedules the tasklet and the tasklet rearms the timer,
+	 * so stop both from rearming first.  Then wait for a running
+	 * tasklet, for the timer, and for a tasklet the timer might have
+	 * scheduled in the meantime.
+	 */
+	spin_lock_irq(&dum_hcd->dum->lock);
+	set_bit(DUMMY_STOPPING, &dum_hcd->sched_flags);
+	spin_unlock_irq(&dum_hcd->dum->lock);
+	tasklet_kill(&dum_hcd->sched);
+	del_timer_sync(&dum_hcd->timer);
+	tasklet_kill(&dum_hcd->sched);
+	device_remove_file(dummy_dev(hcd_to_dummy_hcd(hcd)), &dev_attr_sched);
 	device_remove_file(dummy_dev(hcd_to_dummy_hcd(hcd)), &dev_attr_urbs);
 	dev_info(dummy_dev(hcd_to_dummy_hcd(hcd)), "stopped\n");
 }
@@ -2581,6 +3847,7 @@ static int dummy_alloc_streams(struct usb_hcd *hcd, struct usb_device *udev,
 			ret_streams = -EINVAL;
 			goto out;
 		}
+		max_stream = min_t(int, max_stream, DUMMY_MAX_STREAMS);
 		if (max_stream < ret_streams) {
 			dev_dbg(dummy_dev(dum_hcd), "Ep 0x%x only supports %u "
 					"stream IDs.\n",
@@ -2593,8 +3860,7 @@ static int dummy_alloc_streams(struct usb_hcd *hcd, struct usb_device *udev,
 	for (i = 0; i < num_eps; i++) {
 		index = dummy_get_ep_idx(&eps[i]->desc);
 		dum_hcd->stream_en_ep |= 1 << index;
-		set_max_streams_for_pipe(dum_hcd,
-				usb_endpoint_num(&eps[i]->desc), ret_streams);
+		set_max_streams_for_ep(dum_hcd, &eps[i]->desc, ret_streams);
 	}
 out:
 	spin_unlock_irqrestore(&dum_hcd->dum->lock, flags);
@@ -2624,8 +3890,7 @@ static int dummy_free_streams(struct usb_hcd *hcd, struct usb_device *udev,
 	for (i = 0; i < num_eps; i++) {
 		index = dummy_get_ep_idx(&eps[i]->desc);
 		dum_hcd->stream_en_ep &= ~(1 << index);
-		set_max_streams_for_pipe(dum_hcd,
-				usb_endpoint_num(&eps[i]->desc), 0);
+		set_max_streams_for_ep(dum_hcd, &eps[i]->desc, 0);
 	}
 	ret = 0;
 out:
@@ -2766,7 +4031,126 @@ static struct platform_driver dummy_hcd_driver = {
 };
 
 /*-------------------------------------------------------------------------*/
-#define MAX_NUM_UDC	32
+
+/* parse one "eps" entry, see the endpoint table */
+static int dummy_parse_ep(struct dummy_ep_cfg *cfg, char *spec)
+{
+	unsigned	type = TYPE_BULK_OR_INT;
+	unsigned	dir, num = 0;
+	size_t		len;
+	char		*p;
+
+	cfg->maxpacket_limit = ~0;
+	cfg->address = 0;
+	p = strchr(spec, '/');
+	if (p) {
+		*p++ = '\0';
+		if (kstrtouint(p, 0, &cfg->maxpacket_limit) ||
+				!cfg->maxpacket_limit ||
+				cfg->maxpacket_limit > 1024)
+			return -EINVAL;
+	}
+
+	if (strncmp(spec, "ep", 2) ||
+			strscpy(cfg->name, spec, sizeof(cfg->name)) < 0)
+		return -EINVAL;
+
+	/* no "-iso": we don't support isochronous transfers */
+	p = strrchr(spec, '-');
+	if (p && p != spec + 2) {
+		*p++ = '\0';
+		if (!strcmp(p, "bulk"))
+			type = USB_EP_CAPS_TYPE_BULK;
+		else if (!strcmp(p, "int"))
+			type = USB_EP_CAPS_TYPE_INT;
+		else
+			return -EINVAL;
+	}
+
+	len = strlen(spec);
+	if (len > 2 && !strcmp(spec + len - 2, "in"))
+		dir = USB_EP_CAPS_DIR_IN;
+	else if (len > 3 && !strcmp(spec + len - 3, "out"))
+		dir = USB_EP_CAPS_DIR_OUT;
+	else
+		dir = USB_EP_CAPS_DIR_ALL;
+
+	if (isdigit(spec[2])) {
+		/* fixed function: "ep<number><in|out>" */
+		for (p = spec + 2; isdigit(*p); p++)
+			num = num * 10 + *p - '0';
+		if (num < 1 || num > 15 ||
+				(strcmp(p, "in") && strcmp(p, "out")))
+			return -EINVAL;
+		cfg->address = num;
+		if (dir == USB_EP_CAPS_DIR_IN)
+			cfg->address |= USB_DIR_IN;
+	} else if (spec[2] != '-' || !spec[3]) {
+		return -EINVAL;
+	}
+
+	cfg->caps = (struct usb_ep_caps) USB_EP_CAPS(type, dir);
+	return 0;
+}
+
+static int dummy_init_eps(struct dummy *dum, const char *spec)
+{
+	struct dummy_ep_cfg	*cfg;
+	char			*buf, *cur, *entry;
+	int			i, retval = 0;
+
+	BUILD_BUG_ON(ARRAY_SIZE(ep_info) > DUMMY_MAX_ENDPOINTS);
+
+	/* ep0 is always there */
+	strscpy(dum->ep_cfg[0].name, ep0name, sizeof(dum->ep_cfg[0].name));
+	dum->ep_cfg[0].caps = ep_info[0].caps;
+	dum->ep_cfg[0].maxpacket_limit = ~0;
+	dum->num_eps = 1;
+
+	if (!spec || !*spec) {
+		for (i = 1; i < ARRAY_SIZE(ep_info); i++) {
+			cfg = &dum->ep_cfg[i];
+			strscpy(cfg->name, ep_info[i].name, sizeof(cfg->name));
+			cfg->caps = ep_info[i].caps;
+			cfg->maxpacket_limit = ~0;
+		}
+		dum->num_eps = ARRAY_SIZE(ep_info);
+		return 0;
+	}
+
+	buf = kstrdup(spec, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	cur = buf;
+	while ((entry = strsep(&cur, ":")) != NULL) {
+		if (dum->num_eps == DUMMY_MAX_ENDPOINTS) {
+			retval = -E2BIG;
+			break;
+		}
+		cfg = &dum->ep_cfg[dum->num_eps];
+		retval = dummy_parse_ep(cfg, entry);
+		if (retval)
+			break;
+		/*
+		 * Fixed endpoints clash by address, whatever their type
+		 * suffix, since find_endpoint() would only see one of them.
+		 */
+		for (i = 0; i < dum->num_eps; i++) {
+			if (!strcmp(dum->ep_cfg[i].name, cfg->name) ||
+					(cfg->address && cfg->address ==
+					 dum->ep_cfg[i].address))
+				retval = -EEXIST;
+		}
+		if (retval)
+			break;
+		dum->num_eps++;
+	}
+	if (retval)
+		pr_err("bad endpoint #%u in \"%s\"\n", dum->num_eps, spec);
+	kfree(buf);
+	return retval;
+}
+
 static struct platform_device *the_udc_pdev[MAX_NUM_UDC];
 static struct platform_device *the_hcd_pdev[MAX_NUM_UDC];
 
@@ -2812,6 +4196,9 @@ static int __init init(void)
 			retval = -ENOMEM;
 			goto err_add_pdata;
 		}
+		retval = dummy_init_eps(dum[i], mod_data.eps[i]);
+		if (retval)
+			goto err_add_pdata;
 		retval = platform_device_add_data(the_hcd_pdev[i], &dum[i],
 				sizeof(void *));
 		if (retval)
@@ -2822,6 +4209,7 @@ static int __init init(void)
 			goto err_add_pdata;
 	}
 
+	dummy_debugfs_init();
 	retval = platform_driver_register(&dummy_hcd_driver);
 	if (retval < 0)
 		goto err_add_pdata;
@@ -2883,6 +4271,7 @@ err_add_hcd:
 err_register_udc_driver:
 	platform_driver_unregister(&dummy_hcd_driver);
 err_add_pdata:
+	dummy_debugfs_exit();
 	for (i = 0; i < mod_data.num; i++)
 		kfree(dum[i]);
 	for (i = 0; i < mod_data.num; i++)
@@ -2909,5 +4298,6 @@ static void __exit cleanup(void)
 	}
 	platform_driver_unregister(&dummy_udc_driver);
 	platform_driver_unregister(&dummy_hcd_driver);
+	dummy_debugfs_exit();
 }
 module_exit(cleanup);
@@ -0,0 +1,248 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// A helper program to measure control transfer round-trip latency.
+// Issues the vendor requests implemented by gadget.c back to back through
+// usbdevfs and reports latency percentiles and histograms.
+// Part of the USB Raw Gadget test suite.
+// See https://github.com/xairy/raw-gadget for details.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <linux/usb/ch9.h>
+#include <linux/usbdevice_fs.h>
+
+#include "latency.h"
+
+// Must match gadget.c.
+#define VENDOR_REQ_OUT	0x5b
+#define VENDOR_REQ_IN	0x5c
+
+#define VENDOR_BUFFER_SIZE 256
+
+#define LENGTHS_MAX	32
+#define TIMEOUT_MS	1000
+
+struct result {
+	const char	*direction;
+	unsigned	length;
+	unsigned	requests;
+	unsigned	mismatches;
+	struct latency	latency;
+};
+
+static int vendor_request(int fd, bool in, unsigned char *data,
+				unsigned length) {
+	struct usbdevfs_ctrltransfer ctrl;
+	ctrl.bRequestType = USB_TYPE_VENDOR | USB_RECIP_DEVICE |
+					(in ? USB_DIR_IN : USB_DIR_OUT);
+	ctrl.bRequest = in ? VENDOR_REQ_IN : VENDOR_REQ_OUT;
+	ctrl.wValue = 0;
+	ctrl.wIndex = 0;
+	ctrl.wLength = length;
+	ctrl.timeout = TIMEOUT_MS;
+	ctrl.data = data;
+	return ioctl(fd, USBDEVFS_CONTROL, &ctrl);
+}
+
+static int run(int fd, bool in, unsigned length, unsigned count,
+			unsigned warmup, uint64_t *samples,
+			struct result *res) {
+	unsigned char pattern[VENDOR_BUFFER_SIZE];
+	unsigned char data[VENDOR_BUFFER_SIZE];
+
+	for (int i = 0; i < sizeof(pattern); i++)
+		pattern[i] = i % 63;
+
+	res->direction = in ? "in" : "out";
+	res->length = length;
+	res->mismatches = 0;
+
+	// The gadget returns what was last written with VENDOR_REQ_OUT.
+	if (in && vendor_request(fd, false, pattern, length) < 0)
+		return -1;
+
+	for (unsigned i = 0; i < warmup + count; i++) {
+		uint64_t start = now_ns();
+		int rv = vendor_request(fd, in, in ? data : pattern, length);
+		uint64_t end = now_ns();
+
+		if (rv < 0)
+			return -1;
+		if (i < warmup)
+			continue;
+		samples[i - warmup] = end - start;
+		if (in && (rv != length || memcmp(data, pattern, length)))
+			res->mismatches++;
+	}
+
+	res->requests = count;
+	summarize(&res->latency, samples, count);
+	return 0;
+}
+
+static void print_result(const char *device, const struct result *res,
+				bool json, bool histogram) {
+	const struct latency *lat = &res->latency;
+
+	if (json) {
+		printf("{\"device\": ");
+		print_json_string(device);
+		printf(", \"direction\": \"%s\", \"length\": %u, "
+			"\"requests\": %u, \"mismatches\": %u, ",
+			res->direction, res->length, res->requests,
+			res->mismatches);
+		print_latency_json(lat);
+		printf("}\n");
+		return;
+	}
+
+	printf("%s %-3s %3u bytes: %u requests, min %.1f us, mean %.1f us, "
+		"p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us",
+		device, res->direction, res->length, res->requests,
+		lat->min, lat->mean, lat->p50, lat->p99, lat->p999, lat->max);
+	if (res->mismatches)
+		printf(", %u MISMATCHES", res->mismatches);
+	printf("\n");
+
+	if (histogram)
+		print_histogram(lat);
+}
+
+static int parse_lengths(char *str, unsigned *lengths, int *num) {
+	*num = 0;
+	for (char *tok = strtok(str, ","); tok; tok = strtok(NULL, ",")) {
+		if (*num == LENGTHS_MAX)
+			return -1;
+		if (parse_num(tok, &lengths[*num]))
+			return -1;
+		if (lengths[*num] > VENDOR_BUFFER_SIZE)
+			return -1;
+		(*num)++;
+	}
+	return *num ? 0 : -1;
+}
+
+int main (int argc, char **argv) {
+	unsigned lengths[LENGTHS_MAX] = {8, 64, 256};
+	int lengths_num = 3;
+	unsigned count = 10000;
+	unsigned warmup = 100;
+	bool do_out = true, do_in = true;
+
+	char *device = NULL;
+	bool json = false;
+	bool histogram = false;
+
+	static const struct option long_options[] = {
+		{"json", no_argument, NULL, 'j'},
+		{"histogram", no_argument, NULL, 'H'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0},
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "D:c:w:s:d:jHh",
+					long_options, NULL)) != EOF) {
+		switch (opt) {
+		case 'D':  // Device path, e.g. /dev/bus/usb/005/003.
+			device = optarg;
+			continue;
+		case 'c':  // Requests per length and direction.
+			if (parse_num(optarg, &count) || count == 0)
+				goto usage;
+			continue;
+		case 'w':  // Warm-up requests, not accounted.
+			if (parse_num(optarg, &warmup))
+				goto usage;
+			continue;
+		case 's':  // Comma-separated wLength values.
+			if (parse_lengths(optarg, &lengths[0], &lengths_num))
+				goto usage;
+			continue;
+		case 'd':  // Direction.
+			do_out = !strcmp(optarg, "out") ||
+					!strcmp(optarg, "both");
+			do_in = !strcmp(optarg, "in") ||
+					!strcmp(optarg, "both");
+			if (!do_out && !do_in)
+				goto usage;
+			continue;
+		case 'j':  // Machine-readable output.
+			json = true;
+			continue;
+		case 'H':  // Print latency histograms.
+			histogram = true;
+			continue;
+		case 'h':
+		default:
+usage:
+			fprintf (stderr,
+				"usage: %s [options]\n"
+				"Options:\n"
+				"\t-D device path\n"
+				"\t-c requests\t\tdefault 10000\n"
+				"\t-w warm-up requests\tdefault 100\n"
+				"\t-s lengths\t\tcomma-separated, at most %d, "
+				"default 8,64,256\n"
+				"\t-d out|in|both\t\tdefault both\n"
+				"\t-j, --json\t\tprint results as JSON\n"
+				"\t-H, --histogram\t\tprint latency histograms\n",
+				argv[0], VENDOR_BUFFER_SIZE);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc)
+		goto usage;
+	if (!device)
+		goto usage;
+
+	int fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror("open(device)");
+		return EXIT_FAILURE;
+	}
+
+	uint64_t *samples = calloc(count, sizeof(samples[0]));
+	if (!samples) {
+		perror("calloc()");
+		return EXIT_FAILURE;
+	}
+
+	int status = EXIT_SUCCESS;
+	for (int i = 0; i < lengths_num; i++) {
+		for (int in = 0; in < 2; in++) {
+			struct result res;
+
+			if ((in && !do_in) || (!in && !do_out))
+				continue;
+			if (run(fd, in, lengths[i], count, warmup,
+						samples, &res)) {
+				perror("ioctl(USBDEVFS_CONTROL)");
+				return EXIT_FAILURE;
+			}
+			print_result(device, &res, json, histogram);
+			if (res.mismatches)
+				status = EXIT_FAILURE;
+		}
+	}
+
+	free(samples);
+	close(fd);
+
+	return status;
+}
@@ -1,6 +1,7 @@
 #!/usr/bin/env python3
 # SPDX-License-Identifier: Apache-2.0
 
+import argparse
 import errno
 import json
 import os
@@ -34,8 +35,102 @@ def format_results(raw_filename, zero_filename):
 		print("| %s | %s | %s | %s |" % \
 			(test, raw_status, zero_status, status))
 
+def bench_key(result):
+	return (result["num"], result["count"], result["length"],
+		result["sglen"])
+
+def format_mbps(result):
+	if result is None:
+		return "-"
+	if not result["duration"]:
+		return errno.errorcode.get(result["errno"], str(result["errno"]))
+	if not result["mbps"]:
+		return "n/a"	# E.g. control tests.
+	return "%.3f" % (result["mbps"]["median"],)
+
+# Compares the median durations of each benchmark point.  A point
+# regresses when the candidate is slower than the baseline by more than
+# the threshold and by more than `noise` standard deviations of the
+# noisier of the two runs, so that jitter alone doesn't fail the gate.
+# Points that only one of the logs has fail too, so that a test that
+# stopped running doesn't pass as no regression.
+def compare_bench(candidate_filename, baseline_filename, threshold, noise):
+	candidate = read_log(candidate_filename)
+	baseline = read_log(baseline_filename)
+	base = dict((bench_key(r), r) for r in baseline["results"])
+	cand = set(bench_key(r) for r in candidate["results"])
+	missing = [r for r in baseline["results"] if bench_key(r) not in cand]
+
+	print("Candidate: %s on %s, kernel %s" % (
+		candidate["metadata"]["gadget"], candidate["metadata"]["udc"],
+		candidate["metadata"]["kernel"]))
+	print("Baseline: %s on %s, kernel %s" % (
+		baseline["metadata"]["gadget"], baseline["metadata"]["udc"],
+		baseline["metadata"]["kernel"]))
+	print("")
+	print("| Test | Count | Length | S/G | Baseline MB/s | " +
+		"Candidate MB/s | Relative | Status |")
+	print("| :--- | ---: | ---: | ---: | ---: | ---: | ---: | :---: |")
+
+	regressions = 0
+	unmatched = len(missing)
+	for c in candidate["results"]:
+		b = base.get(bench_key(c))
+		relative = ""
+		status = "OK"
+		if b is None:
+			status = "**NO BASELINE**"
+		elif not c["duration"] and b["duration"]:
+			status = "**FAIL**"
+		elif c["duration"] and b["duration"]:
+			cd = c["duration"]
+			bd = b["duration"]
+			ratio = bd["median"] / cd["median"] \
+				if cd["median"] > 0 else 1.0
+			relative = "%.1f%%" % (ratio * 100,)
+			slowdown = cd["median"] - bd["median"]
+			sigma = max(cd["stddev"], bd["stddev"])
+			if slowdown > bd["median"] * threshold / 100.0 and \
+					slowdown > noise * sigma:
+				status = "**SLOWER**"
+			elif slowdown > bd["median"] * threshold / 100.0:
+				status = "noise"
+		if b is None:
+			unmatched += 1
+		elif status in ("**FAIL**", "**SLOWER**"):
+			regressions += 1
+		print("| %s | %d | %d | %d | %s | %s | %s | %s |" % (
+			c["test"], c["count"], c["length"], c["sglen"],
+			format_mbps(b), format_mbps(c), relative, status))
+	for b in missing:
+		print("| %s | %d | %d | %d | %s | %s | | %s |" % (
+			b["test"], b["count"], b["length"], b["sglen"],
+			format_mbps(b), format_mbps(None), "**MISSING**"))
+
+	print("")
+	print("%d regression(s) beyond %g%%" % (regressions, threshold))
+	if unmatched:
+		print("%d point(s) missing from one of the logs" % (unmatched,))
+	return regressions + unmatched
+
 if __name__ == '__main__':
-	if len(sys.argv) != 3:
-		print("Usage: %s <RAW_GADGET.LOG> <G_ZERO.LOG>" % (sys.argv[0],))
-		sys.exit(-1)
-	format_results(sys.argv[1], sys.argv[2])
+	parser = argparse.ArgumentParser()
+	parser.add_argument("raw", metavar="RAW_GADGET.LOG",
+			help="candidate log (benchmark log with --perf)")
+	parser.add_argument("zero", metavar="G_ZERO.LOG",
+			help="baseline log (benchmark log with --perf)")
+	parser.add_argument("--perf", action="store_true",
+			help="compare run_tests.py --bench timings")
+	parser.add_argument("--threshold", type=float, default=5.0,
+			help="allowed slowdown in percent (default 5)")
+	parser.add_argument("--noise", type=float, default=2.0,
+			help="slowdowns within this many standard deviations "
+				"are treated as noise (default 2)")
+	args = parser.parse_args()
+
+	if args.perf:
+		r = compare_bench(args.raw, args.zero, args.threshold,
+				args.noise)
+		sys.exit(1 if r else 0)
+
+	format_results(args.raw, args.zero)
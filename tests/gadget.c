@@ -7,21 +7,32 @@
 // Andrey Konovalov <andreyknvl@gmail.com>
 
 #include <assert.h>
+#include <dirent.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <semaphore.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#ifdef GADGET_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 
 #include <linux/types.h>
 #include <linux/usb/ch9.h>
@@ -195,6 +206,14 @@ int usb_raw_ep_write(int fd, struct usb_raw_ep_io *io) {
 	return rv;
 }
 
+// Same as usb_raw_ep_enable(), but doesn't fail when enabling fails.
+int usb_raw_ep_enable_optional(int fd, struct usb_endpoint_descriptor *desc) {
+	int rv = ioctl(fd, USB_RAW_IOCTL_EP_ENABLE, desc);
+	if (rv < 0)
+		perror("ioctl(USB_RAW_IOCTL_EP_ENABLE)");
+	return rv;
+}
+
 void usb_raw_configure(int fd) {
 	int rv = ioctl(fd, USB_RAW_IOCTL_CONFIGURE, 0);
 	if (rv < 0) {
@@ -236,6 +255,22 @@ void usb_raw_ep_set_halt(int fd, int ep) {
 	}
 }
 
+void usb_raw_ep_clear_halt(int fd, int ep) {
+	int rv = ioctl(fd, USB_RAW_IOCTL_EP_CLEAR_HALT, ep);
+	if (rv < 0) {
+		perror("ioctl(USB_RAW_IOCTL_EP_CLEAR_HALT)");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void usb_raw_ep_set_wedge(int fd, int ep) {
+	int rv = ioctl(fd, USB_RAW_IOCTL_EP_SET_WEDGE, ep);
+	if (rv < 0) {
+		perror("ioctl(USB_RAW_IOCTL_EP_SET_WEDGE)");
+		exit(EXIT_FAILURE);
+	}
+}
+
 /*----------------------------------------------------------------------*/
 
 void log_control_request(struct usb_ctrlrequest *ctrl) {
@@ -384,6 +419,11 @@ void log_event(struct usb_raw_event *event) {
 /*----------------------------------------------------------------------*/
 
 #define BCD_USB		0x0200
+#define BCD_USB_SS	0x0320
+
+// Selected with --speed and --bcd-usb, see set_speed().
+enum usb_device_speed speed = USB_SPEED_HIGH;
+unsigned int bcd_usb = BCD_USB;
 
 // Pretend to be Linux Gadget Zero to unlock more testing features.
 #define USB_VENDOR	0x0525
@@ -399,11 +439,29 @@ void log_event(struct usb_raw_event *event) {
 #define EP_MAX_PACKET_BULK	512
 #define EP_MAX_PACKET_INT	8
 
+#define EP_MAX_PACKET_CONTROL_SS_EXP	9	// 512 bytes
+#define EP_MAX_PACKET_BULK_SS		1024
+#define EP_MAX_BURST_SS			4	// Packets, up to 16.
+
+// Default U1/U2 exit latencies from the kernel's composite framework.
+#define SS_U1_DEV_EXIT_LAT	0x01
+#define SS_U2_DEV_EXIT_LAT	0x01f4
+
+unsigned int bulk_max_packet = EP_MAX_PACKET_BULK;
+
+// One iso packet per (micro)frame interval, 1 ms for both speeds.
+#define EP_MAX_PACKET_ISO_HS	1024
+#define EP_MAX_PACKET_ISO_FS	1023
+#define EP_INTERVAL_ISO_HS	4
+#define EP_INTERVAL_ISO_FS	1
+
 // Assigned dynamically.
 #define EP_NUM_BULK_OUT	0x0
 #define EP_NUM_BULK_IN	0x0
 #define EP_NUM_INT_OUT	0x0
 #define EP_NUM_INT_IN	0x0
+#define EP_NUM_ISO_OUT	0x0
+#define EP_NUM_ISO_IN	0x0
 
 struct usb_device_descriptor usb_device = {
 	.bLength =		USB_DT_DEVICE_SIZE,
@@ -469,8 +527,28 @@ struct usb_interface_descriptor usb_interface_alt1 = {
 	.iInterface =		STRING_ID_INTERFACE,
 };
 
+// Same as alt0 plus iso endpoints, only reported when the UDC has them.
+// Select it with the usbtest alt=2 module parameter for tests #15, #16,
+// #22 and #23.
+struct usb_interface_descriptor usb_interface_alt2 = {
+	.bLength =		USB_DT_INTERFACE_SIZE,
+	.bDescriptorType =	USB_DT_INTERFACE,
+	.bInterfaceNumber =	0,
+	.bAlternateSetting =	2,
+	.bNumEndpoints =	6,
+	.bInterfaceClass =	USB_CLASS_VENDOR_SPEC,
+	.bInterfaceSubClass =	0,
+	.bInterfaceProtocol =	0,
+	.iInterface =		STRING_ID_INTERFACE,
+};
+
+#define ALT_ISO	2
+
 struct usb_interface_descriptor *usb_interface_alts[] =
-	{ &usb_interface_alt0, &usb_interface_alt1 };
+	{ &usb_interface_alt0, &usb_interface_alt1, &usb_interface_alt2 };
+
+#define USB_INTERFACE_ALTS_NUM \
+	(sizeof(usb_interface_alts) / sizeof(usb_interface_alts[0]))
 
 struct usb_endpoint_descriptor usb_endpoint_bulk_out = {
 	.bLength =		USB_DT_ENDPOINT_SIZE,
@@ -508,62 +586,175 @@ struct usb_endpoint_descriptor usb_endpoint_int_in = {
 	.bInterval =		5,
 };
 
+struct usb_endpoint_descriptor usb_endpoint_iso_out = {
+	.bLength =		USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType =	USB_DT_ENDPOINT,
+	.bEndpointAddress =	USB_DIR_OUT | EP_NUM_ISO_OUT,
+	.bmAttributes =		USB_ENDPOINT_XFER_ISOC | USB_ENDPOINT_SYNC_ASYNC,
+	.wMaxPacketSize =	EP_MAX_PACKET_ISO_HS,
+	.bInterval =		EP_INTERVAL_ISO_HS,
+};
+
+struct usb_endpoint_descriptor usb_endpoint_iso_in = {
+	.bLength =		USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType =	USB_DT_ENDPOINT,
+	.bEndpointAddress =	USB_DIR_IN | EP_NUM_ISO_IN,
+	.bmAttributes =		USB_ENDPOINT_XFER_ISOC | USB_ENDPOINT_SYNC_ASYNC,
+	.wMaxPacketSize =	EP_MAX_PACKET_ISO_HS,
+	.bInterval =		EP_INTERVAL_ISO_HS,
+};
+
+// Set once both iso endpoints got addresses, see process_eps_info().
+bool iso_available = false;
+
+// SuperSpeed endpoint companions, only used with --speed super.
+
+struct usb_ss_ep_comp_descriptor usb_ss_comp_bulk = {
+	.bLength =		USB_DT_SS_EP_COMP_SIZE,
+	.bDescriptorType =	USB_DT_SS_ENDPOINT_COMP,
+	.bMaxBurst =		EP_MAX_BURST_SS - 1,
+	.bmAttributes =		0,
+	.wBytesPerInterval =	0,
+};
+
+struct usb_ss_ep_comp_descriptor usb_ss_comp_int = {
+	.bLength =		USB_DT_SS_EP_COMP_SIZE,
+	.bDescriptorType =	USB_DT_SS_ENDPOINT_COMP,
+	.bMaxBurst =		0,
+	.bmAttributes =		0,
+	.wBytesPerInterval =	__constant_cpu_to_le16(EP_MAX_PACKET_INT),
+};
+
+struct usb_ss_ep_comp_descriptor usb_ss_comp_iso = {
+	.bLength =		USB_DT_SS_EP_COMP_SIZE,
+	.bDescriptorType =	USB_DT_SS_ENDPOINT_COMP,
+	.bMaxBurst =		0,
+	.bmAttributes =		0,
+	.wBytesPerInterval =	__constant_cpu_to_le16(EP_MAX_PACKET_ISO_HS),
+};
+
 struct usb_bos_descriptor usb_bos = {
 	.bLength =		USB_DT_BOS_SIZE,
 	.bDescriptorType =	USB_DT_BOS,
-	.wTotalLength =		USB_DT_BOS_SIZE,
-	.bNumDeviceCaps =	0,
+	.wTotalLength =		0,  // computed later
+	.bNumDeviceCaps =	0,  // computed later
+};
+
+struct usb_ext_cap_descriptor usb_ext_cap = {
+	.bLength =		USB_DT_USB_EXT_CAP_SIZE,
+	.bDescriptorType =	USB_DT_DEVICE_CAPABILITY,
+	.bDevCapabilityType =	USB_CAP_TYPE_EXT,
+	.bmAttributes =		__constant_cpu_to_le32(USB_LPM_SUPPORT),
+};
+
+struct usb_ss_cap_descriptor usb_ss_cap = {
+	.bLength =		USB_DT_USB_SS_CAP_SIZE,
+	.bDescriptorType =	USB_DT_DEVICE_CAPABILITY,
+	.bDevCapabilityType =	USB_SS_CAP_TYPE,
+	.bmAttributes =		0,
+	.wSpeedSupported =	__constant_cpu_to_le16(USB_HIGH_SPEED_OPERATION |
+							USB_5GBPS_OPERATION),
+	.bFunctionalitySupport = USB_LOW_SPEED_OPERATION,
+	.bU1devExitLat =	SS_U1_DEV_EXIT_LAT,
+	.bU2DevExitLat =	__constant_cpu_to_le16(SS_U2_DEV_EXIT_LAT),
 };
 
+// Adjusts the descriptors to the selected speed and USB version. Only high
+// and super speeds are supported, and the UDC must run at that speed.
+void set_speed(enum usb_device_speed new_speed, unsigned int bcd,
+			unsigned int max_burst) {
+	speed = new_speed;
+	bcd_usb = bcd;
+	if (speed == USB_SPEED_SUPER) {
+		usb_device.bMaxPacketSize0 = EP_MAX_PACKET_CONTROL_SS_EXP;
+		bulk_max_packet = EP_MAX_PACKET_BULK_SS;
+		usb_ss_comp_bulk.bMaxBurst = max_burst - 1;
+	}
+	usb_device.bcdUSB = __cpu_to_le16(bcd_usb);
+	usb_qualifier.bcdUSB = __cpu_to_le16(bcd_usb);
+	usb_endpoint_bulk_out.wMaxPacketSize = __cpu_to_le16(bulk_max_packet);
+	usb_endpoint_bulk_in.wMaxPacketSize = __cpu_to_le16(bulk_max_packet);
+}
+
+void append_descriptor(char **data, int *length, int *total_length,
+				const void *desc, int size) {
+	assert(*length >= size);
+	memcpy(*data, desc, size);
+	*data += size;
+	*length -= size;
+	*total_length += size;
+}
+
+// Appends an endpoint descriptor followed by its companion at SuperSpeed.
+void append_endpoint(char **data, int *length, int *total_length,
+		struct usb_endpoint_descriptor *ep,
+		struct usb_ss_ep_comp_descriptor *comp) {
+	append_descriptor(data, length, total_length,
+				ep, USB_DT_ENDPOINT_SIZE);
+	if (speed == USB_SPEED_SUPER)
+		append_descriptor(data, length, total_length,
+					comp, USB_DT_SS_EP_COMP_SIZE);
+}
+
+// Appends an iso endpoint descriptor with packet size and interval
+// adjusted to the speed the configuration is built for.
+void append_iso_endpoint(char **data, int *length, int *total_length,
+		struct usb_endpoint_descriptor *ep, bool full_speed) {
+	struct usb_endpoint_descriptor desc = *ep;
+	if (full_speed) {
+		desc.wMaxPacketSize = __cpu_to_le16(EP_MAX_PACKET_ISO_FS);
+		desc.bInterval = EP_INTERVAL_ISO_FS;
+	}
+	append_endpoint(data, length, total_length, &desc, &usb_ss_comp_iso);
+}
+
+// Don't log ep0 events and endpoint info, set in the enumeration benchmark.
+bool quiet = false;
+
+// The device runs at high or super speed, the other speed configuration
+// is the full speed one.
 int build_config(char *data, int length, bool other_speed) {
 	struct usb_config_descriptor *config =
 		(struct usb_config_descriptor *)data;
 	int total_length = 0;
 
-	assert(length >= sizeof(usb_config));
-	memcpy(data, &usb_config, sizeof(usb_config));
-	data += sizeof(usb_config);
-	length -= sizeof(usb_config);
-	total_length += sizeof(usb_config);
-
-	assert(length >= sizeof(usb_interface_alt0));
-	memcpy(data, &usb_interface_alt0, sizeof(usb_interface_alt0));
-	data += sizeof(usb_interface_alt0);
-	length -= sizeof(usb_interface_alt0);
-	total_length += sizeof(usb_interface_alt0);
-
-	assert(length >= USB_DT_ENDPOINT_SIZE);
-	memcpy(data, &usb_endpoint_bulk_out, USB_DT_ENDPOINT_SIZE);
-	data += USB_DT_ENDPOINT_SIZE;
-	length -= USB_DT_ENDPOINT_SIZE;
-	total_length += USB_DT_ENDPOINT_SIZE;
-
-	assert(length >= USB_DT_ENDPOINT_SIZE);
-	memcpy(data, &usb_endpoint_bulk_in, USB_DT_ENDPOINT_SIZE);
-	data += USB_DT_ENDPOINT_SIZE;
-	length -= USB_DT_ENDPOINT_SIZE;
-	total_length += USB_DT_ENDPOINT_SIZE;
-
-	assert(length >= USB_DT_ENDPOINT_SIZE);
-	memcpy(data, &usb_endpoint_int_out, USB_DT_ENDPOINT_SIZE);
-	data += USB_DT_ENDPOINT_SIZE;
-	length -= USB_DT_ENDPOINT_SIZE;
-	total_length += USB_DT_ENDPOINT_SIZE;
-
-	assert(length >= USB_DT_ENDPOINT_SIZE);
-	memcpy(data, &usb_endpoint_int_in, USB_DT_ENDPOINT_SIZE);
-	data += USB_DT_ENDPOINT_SIZE;
-	length -= USB_DT_ENDPOINT_SIZE;
-	total_length += USB_DT_ENDPOINT_SIZE;
-
-	assert(length >= sizeof(usb_interface_alt1));
-	memcpy(data, &usb_interface_alt1, sizeof(usb_interface_alt1));
-	data += sizeof(usb_interface_alt1);
-	length -= sizeof(usb_interface_alt1);
-	total_length += sizeof(usb_interface_alt1);
+	append_descriptor(&data, &length, &total_length,
+				&usb_config, sizeof(usb_config));
+
+	append_descriptor(&data, &length, &total_length,
+				&usb_interface_alt0, sizeof(usb_interface_alt0));
+	append_endpoint(&data, &length, &total_length,
+				&usb_endpoint_bulk_out, &usb_ss_comp_bulk);
+	append_endpoint(&data, &length, &total_length,
+				&usb_endpoint_bulk_in, &usb_ss_comp_bulk);
+	append_endpoint(&data, &length, &total_length,
+				&usb_endpoint_int_out, &usb_ss_comp_int);
+	append_endpoint(&data, &length, &total_length,
+				&usb_endpoint_int_in, &usb_ss_comp_int);
+
+	append_descriptor(&data, &length, &total_length,
+				&usb_interface_alt1, sizeof(usb_interface_alt1));
+
+	if (iso_available) {
+		append_descriptor(&data, &length, &total_length,
+			&usb_interface_alt2, sizeof(usb_interface_alt2));
+		append_endpoint(&data, &length, &total_length,
+			&usb_endpoint_bulk_out, &usb_ss_comp_bulk);
+		append_endpoint(&data, &length, &total_length,
+			&usb_endpoint_bulk_in, &usb_ss_comp_bulk);
+		append_endpoint(&data, &length, &total_length,
+			&usb_endpoint_int_out, &usb_ss_comp_int);
+		append_endpoint(&data, &length, &total_length,
+			&usb_endpoint_int_in, &usb_ss_comp_int);
+		append_iso_endpoint(&data, &length, &total_length,
+			&usb_endpoint_iso_out, other_speed);
+		append_iso_endpoint(&data, &length, &total_length,
+			&usb_endpoint_iso_in, other_speed);
+	}
 
 	config->wTotalLength = __cpu_to_le16(total_length);
-	printf("config->wTotalLength: %d\n", total_length);
+	if (!quiet)
+		printf("config->wTotalLength: %d\n", total_length);
 
 	if (other_speed)
 		config->bDescriptorType = USB_DT_OTHER_SPEED_CONFIG;
@@ -573,6 +764,49 @@ int build_config(char *data, int length, bool other_speed) {
 
 /*----------------------------------------------------------------------*/
 
+// Timestamps of a single connect/enumerate/disconnect cycle of the
+// enumeration benchmark, in nanoseconds.
+struct enum_cycle {
+	uint64_t	start;
+	uint64_t	bound;		// USB_RAW_IOCTL_RUN returned.
+	uint64_t	connected;	// USB_RAW_EVENT_CONNECT (bus reset).
+	uint64_t	set_config;	// SET_CONFIGURATION received.
+	uint64_t	acked;		// SET_CONFIGURATION status stage done.
+	uint64_t	configured;	// Host shows the configuration in sysfs.
+	uint64_t	gone;		// Host removed the device after close().
+	unsigned	descriptors;	// GET_DESCRIPTOR requests served.
+};
+
+// Set while the enumeration benchmark runs a cycle.
+struct enum_cycle *enum_cycle = NULL;
+
+uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int build_bos(char *data, int length) {
+	struct usb_bos_descriptor *bos = (struct usb_bos_descriptor *)data;
+	int total_length = 0;
+
+	append_descriptor(&data, &length, &total_length,
+				&usb_bos, sizeof(usb_bos));
+	append_descriptor(&data, &length, &total_length,
+				&usb_ext_cap, sizeof(usb_ext_cap));
+	bos->bNumDeviceCaps = 1;
+	if (speed == USB_SPEED_SUPER) {
+		append_descriptor(&data, &length, &total_length,
+					&usb_ss_cap, sizeof(usb_ss_cap));
+		bos->bNumDeviceCaps++;
+	}
+
+	bos->wTotalLength = __cpu_to_le16(total_length);
+	return total_length;
+}
+
+/*----------------------------------------------------------------------*/
+
 bool assign_ep_address(struct usb_raw_ep_info *info,
 				struct usb_endpoint_descriptor *ep) {
 	if (usb_endpoint_num(ep) != 0)
@@ -590,6 +824,10 @@ bool assign_ep_address(struct usb_raw_ep_info *info,
 		if (!info->caps.type_int)
 			return false;
 		break;
+	case USB_ENDPOINT_XFER_ISOC:
+		if (!info->caps.type_iso)
+			return false;
+		break;
 	default:
 		assert(false);
 	}
@@ -606,7 +844,7 @@ void process_eps_info(int fd) {
 	memset(&info, 0, sizeof(info));
 
 	int num = usb_raw_eps_info(fd, &info);
-	for (int i = 0; i < num; i++) {
+	for (int i = 0; i < num && !quiet; i++) {
 		printf("ep #%d:\n", i);
 		printf("  name: %s\n", &info.eps[i].name[0]);
 		printf("  addr: %u\n", info.eps[i].addr);
@@ -631,23 +869,40 @@ void process_eps_info(int fd) {
 			continue;
 		if (assign_ep_address(&info.eps[i], &usb_endpoint_int_in))
 			continue;
+		if (assign_ep_address(&info.eps[i], &usb_endpoint_iso_out))
+			continue;
+		if (assign_ep_address(&info.eps[i], &usb_endpoint_iso_in))
+			continue;
 	}
 
 	int bulk_out_addr = usb_endpoint_num(&usb_endpoint_bulk_out);
 	assert(bulk_out_addr != 0);
-	printf("bulk_out: addr = %u\n", bulk_out_addr);
+	if (!quiet)
+		printf("bulk_out: addr = %u\n", bulk_out_addr);
 
 	int bulk_in_addr = usb_endpoint_num(&usb_endpoint_bulk_in);
 	assert(bulk_in_addr != 0);
-	printf("bulk_in: addr = %u\n", bulk_in_addr);
+	if (!quiet)
+		printf("bulk_in: addr = %u\n", bulk_in_addr);
 
 	int int_out_addr = usb_endpoint_num(&usb_endpoint_int_out);
 	assert(int_out_addr != 0);
-	printf("int_out: addr = %u\n", int_out_addr);
+	if (!quiet)
+		printf("int_out: addr = %u\n", int_out_addr);
 
 	int int_in_addr = usb_endpoint_num(&usb_endpoint_int_in);
 	assert(int_in_addr != 0);
-	printf("int_in: addr = %u\n", int_in_addr);
+	if (!quiet)
+		printf("int_in: addr = %u\n", int_in_addr);
+
+	// Iso endpoints are optional.
+	int iso_out_addr = usb_endpoint_num(&usb_endpoint_iso_out);
+	int iso_in_addr = usb_endpoint_num(&usb_endpoint_iso_in);
+	iso_available = iso_out_addr != 0 && iso_in_addr != 0;
+	if (!quiet && iso_available) {
+		printf("iso_out: addr = %u\n", iso_out_addr);
+		printf("iso_in: addr = %u\n", iso_in_addr);
+	}
 }
 
 /*----------------------------------------------------------------------*/
@@ -657,45 +912,609 @@ struct usb_raw_control_event {
 	struct usb_ctrlrequest		ctrl;
 };
 
+// Fits the configuration descriptor and the vendor requests.
+#define EP0_IO_SIZE_MAX		1024
+
 struct usb_raw_control_io {
 	struct usb_raw_ep_io		inner;
-	char				data[EP_MAX_PACKET_CONTROL];
+	char				data[EP0_IO_SIZE_MAX];
 };
 
-struct usb_raw_bulk_io {
-	struct usb_raw_ep_io		inner;
-	char				data[EP_MAX_PACKET_BULK];
-};
+// Bulk transfers are allocated dynamically, their size is limited by Raw
+// Gadget (to PAGE_SIZE at the moment of writing), see probe_io_size().
+#define EP_IO_SIZE_DEFAULT	4096
+#define EP_IO_SIZE_PROBE_MAX	(16 << 20)
 
 struct usb_raw_int_io {
 	struct usb_raw_ep_io		inner;
 	char				data[EP_MAX_PACKET_INT];
 };
 
+struct usb_raw_iso_io {
+	struct usb_raw_ep_io		inner;
+	char				data[EP_MAX_PACKET_ISO_HS];
+};
+
+/*----------------------------------------------------------------------*/
+
+// Transfers are accounted in per-endpoint counters and recorded in an
+// in-memory trace ring instead of being printed, so that logging doesn't
+// slow the gadget down. Both are dumped to stderr on SIGUSR1 and on exit,
+// including on SIGINT and SIGTERM. SIGUSR2 toggles verbose logging.
+
+enum stats_id {
+	STATS_EP0,
+	STATS_BULK_OUT,
+	STATS_BULK_IN,
+	STATS_INT_OUT,
+	STATS_INT_IN,
+	STATS_ISO_OUT,
+	STATS_ISO_IN,
+	STATS_NUM,
+};
+
+struct ep_stats {
+	const char		*name;
+	_Atomic uint64_t	transfers;
+	_Atomic uint64_t	bytes;
+	_Atomic uint64_t	errors;
+	_Atomic uint64_t	mismatches;	// Transfers with bad data.
+};
+
+struct ep_stats ep_stats[STATS_NUM] = {
+	[STATS_EP0] = { .name = "ep0" },
+	[STATS_BULK_OUT] = { .name = "bulk_out" },
+	[STATS_BULK_IN] = { .name = "bulk_in" },
+	[STATS_INT_OUT] = { .name = "int_out" },
+	[STATS_INT_IN] = { .name = "int_in" },
+	[STATS_ISO_OUT] = { .name = "iso_out" },
+	[STATS_ISO_IN] = { .name = "iso_in" },
+};
+
+enum trace_kind {
+	TRACE_EVENT,	// value: event type, arg: bRequestType, bRequest, wValue.
+	TRACE_TRANSFER,	// value: ioctl result.
+	TRACE_STALL,
+	TRACE_MISMATCH,	// value: first bad offset, arg: bad bytes.
+	TRACE_HALT,	// value: endpoint, arg: wedged.
+};
+
+// Multiple writers, each one claims a slot by incrementing trace_head.
+// seq is the slot position + 1 once the entry is complete, and 0 while
+// it's being written, so that the reader can skip torn entries.
+struct trace_entry {
+	_Atomic uint64_t	seq;
+	uint64_t		ts;
+	uint8_t			id;
+	uint8_t			kind;
+	int32_t			value;
+	uint32_t		arg;
+};
+
+#define TRACE_SIZE	1024	// Power of two.
+
+struct trace_entry trace_ring[TRACE_SIZE];
+_Atomic uint64_t trace_head;
+
+// Print every transfer and ep0 event, by default unless in fast mode.
+atomic_bool verbose = true;
+
+uint64_t stats_start;
+
+bool log_verbose() {
+	return atomic_load_explicit(&verbose, memory_order_relaxed);
+}
+
+void trace(enum stats_id id, enum trace_kind kind, int32_t value,
+		uint32_t arg) {
+	uint64_t pos = atomic_fetch_add_explicit(&trace_head, 1,
+						memory_order_relaxed);
+	struct trace_entry *entry = &trace_ring[pos % TRACE_SIZE];
+
+	atomic_store_explicit(&entry->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	entry->ts = now_ns();
+	entry->id = id;
+	entry->kind = kind;
+	entry->value = value;
+	entry->arg = arg;
+	atomic_store_explicit(&entry->seq, pos + 1, memory_order_release);
+}
+
+void stats_transfer(enum stats_id id, int rv) {
+	struct ep_stats *stats = &ep_stats[id];
+
+	atomic_fetch_add_explicit(&stats->transfers, 1, memory_order_relaxed);
+	if (rv >= 0)
+		atomic_fetch_add_explicit(&stats->bytes, rv,
+						memory_order_relaxed);
+	else
+		atomic_fetch_add_explicit(&stats->errors, 1,
+						memory_order_relaxed);
+	trace(id, TRACE_TRANSFER, rv, 0);
+}
+
+void stats_event(struct usb_raw_control_event *event) {
+	uint32_t arg = 0;
+
+	if (event->inner.type == USB_RAW_EVENT_CONTROL)
+		arg = event->ctrl.bRequestType | event->ctrl.bRequest << 8 |
+			(uint32_t)__le16_to_cpu(event->ctrl.wValue) << 16;
+	trace(STATS_EP0, TRACE_EVENT, event->inner.type, arg);
+}
+
+// usbtest with pattern=1 (see insmod_usbtest.sh) fills every OUT transfer
+// with (i % wMaxPacketSize) % 63. Reads always start at a packet boundary,
+// so the received data must match the IN pattern buffer, which has the
+// same layout. memcmp() is vectorized by libc, the data is only scanned
+// byte by byte if it doesn't match.
+// Some kernels restart the pattern at every s/g entry though, and with
+// vary (test #7) the entries aren't packet multiples, while Dummy UDC
+// moves the whole s/g list as a single URB. So the scan accepts the
+// pattern restarting, and reads starting in the middle of it. The gadget
+// doesn't know the s/g layout of the running test, so a restart is only
+// accepted if it is followed by RESYNC_RUN_MIN bytes of the pattern (or
+// by the end of the data): zero-filled data never passes as a restart.
+bool verify_data = true;
+
+// Shorter than the shortest s/g entry usbtest makes in the varied tests
+// of run_tests.py.
+#define RESYNC_RUN_MIN	16
+
+// Mismatches are always counted and traced, but only the first ones are
+// printed.
+#define MISMATCH_REPORTS_MAX	16
+
+_Atomic unsigned int mismatch_reports;
+
+unsigned char pattern_byte(int pos, int max_packet) {
+	return (pos % max_packet) % 63;
+}
+
+bool pattern_matches(const unsigned char *data, int length, int pos,
+			int max_packet) {
+	for (int i = 0; i < length; i++)
+		if (data[i] != pattern_byte(pos + i, max_packet))
+			return false;
+	return true;
+}
+
+// Finds the pattern position of data[i], when data[0..i-1] matched up to
+// the pattern position before. Either the pattern restarted within the
+// last packet (the mismatch shows up when the old pattern would start the
+// next packet at the latest), or, within the first packet, the read
+// started in the middle of the pattern.
+bool pattern_resync(const unsigned char *data, int i, int length,
+			int max_packet, int *pos) {
+	for (int j = i; j >= 0 && i - j < max_packet; j--) {
+		int run = length - j < RESYNC_RUN_MIN ?
+					length - j : RESYNC_RUN_MIN;
+		if (run < i - j + 1)
+			run = i - j + 1;
+		if (data[j] == 0 && pattern_matches(&data[j], run,
+							0, max_packet)) {
+			*pos = i - j;
+			return true;
+		}
+	}
+	for (int p = 1; i < max_packet && p < max_packet; p++) {
+		if (pattern_matches(data, i + 1, p, max_packet)) {
+			*pos = p + i;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Returns the number of bytes that don't match the pattern, and the
+// offset and the expected value of the first one.
+int pattern_mismatches(const unsigned char *data, int length,
+			int max_packet, int *first, unsigned char *want) {
+	// Stop resyncing after the first bad byte, so that garbage is
+	// reported rather than matched against every possible position.
+	int bad = 0, pos = 0;
+
+	*first = -1;
+	for (int i = 0; i < length; i++, pos++) {
+		if (data[i] == pattern_byte(pos, max_packet))
+			continue;
+		if (*first == -1 && pattern_resync(data, i, length,
+							max_packet, &pos))
+			continue;
+		if (*first == -1) {
+			*first = i;
+			*want = pattern_byte(pos, max_packet);
+		}
+		bad++;
+	}
+	return bad;
+}
+
+void verify_transfer(enum stats_id id, const void *buf,
+			const void *expected, int length, int max_packet) {
+	const unsigned char *data = buf, *pattern = expected;
+	unsigned char want = 0;
+	int first, bad;
+
+	if (!verify_data || length <= 0 || !memcmp(data, pattern, length))
+		return;
+
+	bad = pattern_mismatches(data, length, max_packet, &first, &want);
+	if (!bad)
+		return;
+
+	atomic_fetch_add_explicit(&ep_stats[id].mismatches, 1,
+					memory_order_relaxed);
+	trace(id, TRACE_MISMATCH, first, bad);
+	if (atomic_fetch_add(&mismatch_reports, 1) < MISMATCH_REPORTS_MAX)
+		fprintf(stderr, "%s: data mismatch at offset %d of %d: "
+			"expected 0x%02x, got 0x%02x, %d bytes differ\n",
+			ep_stats[id].name, first, length,
+			want, data[first], bad);
+}
+
+// Makes sure that the resync logic accepts s/g restarts but still reports
+// zero-filled data, which is what unfilled pages or a lost s/g entry look
+// like.
+void verify_self_check(int max_packet) {
+	unsigned char data[4096];
+	unsigned char want;
+	int first, pos = 0;
+
+	// Entries of a varied s/g list (length 1024, vary 421), read
+	// starting in the middle of the first one.
+	for (int size = 1024, i = 0; i < sizeof(data);) {
+		for (int j = 0; j < size && i < sizeof(data); j++)
+			data[i++] = pattern_byte(j, max_packet);
+		size = (size + 421) % 1024;
+		if (!size)
+			size = 421;
+	}
+	assert(!pattern_mismatches(&data[100], sizeof(data) - 100,
+					max_packet, &first, &want));
+
+	for (int i = 0; i < sizeof(data); i++)
+		data[i] = pattern_byte(pos++, max_packet);
+	memset(&data[max_packet], 0, max_packet);
+	assert(pattern_mismatches(data, sizeof(data), max_packet,
+					&first, &want) >= max_packet / 2);
+
+	memset(data, 0, sizeof(data));
+	assert(pattern_mismatches(data, sizeof(data), max_packet,
+					&first, &want) >= sizeof(data) / 2);
+}
+
+void stats_dump_counters() {
+	double secs = (now_ns() - stats_start) / 1e9;
+
+	fprintf(stderr, "stats: %.3f secs\n", secs);
+	for (int i = 0; i < STATS_NUM; i++) {
+		struct ep_stats *stats = &ep_stats[i];
+		uint64_t transfers = atomic_load(&stats->transfers);
+		uint64_t bytes = atomic_load(&stats->bytes);
+
+		if (!transfers)
+			continue;
+		fprintf(stderr, "  %-8s %12lu transfers, %14lu bytes, "
+			"%8lu errors, %8lu mismatches, %10.3f MB/s\n",
+			stats->name, (unsigned long)transfers,
+			(unsigned long)bytes,
+			(unsigned long)atomic_load(&stats->errors),
+			(unsigned long)atomic_load(&stats->mismatches),
+			bytes / secs / 1e6);
+	}
+}
+
+void stats_dump_trace() {
+	uint64_t head = atomic_load(&trace_head);
+	uint64_t pos = head > TRACE_SIZE ? head - TRACE_SIZE : 0;
+
+	fprintf(stderr, "trace: last %lu of %lu entries\n",
+			(unsigned long)(head - pos), (unsigned long)head);
+	for (; pos < head; pos++) {
+		struct trace_entry *slot = &trace_ring[pos % TRACE_SIZE];
+		struct trace_entry entry;
+
+		uint64_t seq = atomic_load_explicit(&slot->seq,
+						memory_order_acquire);
+		entry.ts = slot->ts;
+		entry.id = slot->id;
+		entry.kind = slot->kind;
+		entry.value = slot->value;
+		entry.arg = slot->arg;
+		atomic_thread_fence(memory_order_acquire);
+		if (seq != pos + 1 || atomic_load_explicit(&slot->seq,
+					memory_order_relaxed) != seq)
+			continue;  // Being overwritten.
+
+		uint64_t ts = entry.ts - stats_start;
+		fprintf(stderr, "  %5lu.%09lu %-8s ", (unsigned long)(ts /
+			1000000000ull), (unsigned long)(ts % 1000000000ull),
+			ep_stats[entry.id].name);
+		switch (entry.kind) {
+		case TRACE_EVENT:
+			fprintf(stderr, "event %d, request 0x%02x 0x%02x, "
+				"value 0x%04x\n", entry.value,
+				entry.arg & 0xff, (entry.arg >> 8) & 0xff,
+				entry.arg >> 16);
+			break;
+		case TRACE_TRANSFER:
+			fprintf(stderr, "transfer %d\n", entry.value);
+			break;
+		case TRACE_STALL:
+			fprintf(stderr, "stall\n");
+			break;
+		case TRACE_MISMATCH:
+			fprintf(stderr, "mismatch at %d, %u bytes\n",
+					entry.value, entry.arg);
+			break;
+		case TRACE_HALT:
+			fprintf(stderr, "%s #%d\n", entry.arg ? "wedge" :
+						"halt", entry.value);
+			break;
+		}
+	}
+}
+
+void stats_dump() {
+	stats_dump_counters();
+	stats_dump_trace();
+}
+
+// Signals are blocked in all threads and handled here, so that dumping
+// doesn't have to be async-signal-safe.
+void *stats_loop(void *arg) {
+	sigset_t *set = (sigset_t *)arg;
+	int sig;
+
+	while (true) {
+		if (sigwait(set, &sig)) {
+			perror("sigwait()");
+			exit(EXIT_FAILURE);
+		}
+		switch (sig) {
+		case SIGUSR1:
+			stats_dump();
+			break;
+		case SIGUSR2:
+			atomic_store(&verbose, !log_verbose());
+			break;
+		default:
+			// Still terminate by the signal, but with the stats.
+			stats_dump();
+			signal(sig, SIG_DFL);
+			pthread_sigmask(SIG_UNBLOCK, set, NULL);
+			raise(sig);
+		}
+	}
+
+	return NULL;
+}
+
+// Must be called before any other thread is created.
+void stats_init() {
+	static sigset_t set;
+	pthread_t thread;
+
+	stats_start = now_ns();
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGUSR2);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	pthread_create(&thread, 0, stats_loop, &set);
+	atexit(stats_dump);
+}
+
+/*----------------------------------------------------------------------*/
+
 int alt_index;
 
+// In fast mode endpoint workers don't log every transfer by default and
+// move bulk_io_size bytes per ioctl instead of a single packet.
+bool fast_mode = false;
+unsigned int bulk_io_size = EP_MAX_PACKET_BULK;  // Set in main().
+
+// Use the largest transfer size Raw Gadget accepts (--io-size max), or just
+// print it and exit (--probe-io-size).
+bool io_size_max = false;
+bool io_size_probe_only = false;
+
+// Prebuilt once, EP_WRITE doesn't modify the buffer. The bulk one is
+// allocated once the transfer size is known, see setup_io_size().
+struct usb_raw_ep_io *bulk_in_pattern;
+struct usb_raw_int_io int_in_pattern;
+struct usb_raw_iso_io iso_in_pattern;
+
+// What the interrupt IN endpoint sends: a copy of int_in_pattern, so that
+// --timestamps doesn't modify the reference the interrupt OUT data is
+// checked against.
+struct usb_raw_int_io int_in_buffer;
+
+// Put the CLOCK_MONOTONIC time at which each interrupt IN report is queued
+// into its first bytes instead of the pattern, for intlat. The host can
+// only compare it with the arrival time when it runs on the same machine,
+// i.e. with Dummy UDC.
+bool int_timestamps = false;
+
+void stamp_int_report(struct usb_raw_int_io *io) {
+	uint64_t ts = now_ns();
+
+	static_assert(sizeof(io->data) >= sizeof(ts), "report too short");
+	memcpy(&io->data[0], &ts, sizeof(ts));
+}
+
+struct usb_raw_ep_io *alloc_bulk_io(unsigned int size) {
+	struct usb_raw_ep_io *io = calloc(1, sizeof(*io) + size);
+	if (!io) {
+		perror("calloc()");
+		exit(EXIT_FAILURE);
+	}
+	return io;
+}
+
+// The pattern usbtest uses with pattern=1. One packet is generated and then
+// copied over the rest of the buffer in doubling chunks.
+void fill_pattern(void *buf, unsigned int size, unsigned int max_packet) {
+	unsigned char *data = buf;
+	unsigned int filled = size < max_packet ? size : max_packet;
+
+	for (int i = 0; i < filled; i++)
+		data[i] = i % 63;
+	while (filled < size) {
+		unsigned int chunk = size - filled < filled ?
+						size - filled : filled;
+		memcpy(&data[filled], &data[0], chunk);
+		filled += chunk;
+	}
+}
+
+void build_patterns() {
+	fill_pattern(&int_in_pattern.data[0], sizeof(int_in_pattern.data),
+						EP_MAX_PACKET_INT);
+	fill_pattern(&iso_in_pattern.data[0], sizeof(iso_in_pattern.data),
+						EP_MAX_PACKET_ISO_HS);
+	int_in_buffer = int_in_pattern;
+}
+
+// Raw Gadget has no way to query the transfer size limit, so probe it:
+// while no endpoints are enabled, EP_WRITE fails with EINVAL if the length
+// is too large, and with EBUSY otherwise, without queueing anything.
+bool io_size_accepted(int fd, struct usb_raw_ep_io *io, unsigned int size) {
+	io->ep = 0;
+	io->flags = 0;
+	io->length = size;
+	int rv = ioctl(fd, USB_RAW_IOCTL_EP_WRITE, io);
+	assert(rv < 0);
+	if (errno == EINVAL)
+		return false;
+	if (errno == EBUSY)
+		return true;
+	perror("ioctl(USB_RAW_IOCTL_EP_WRITE)");
+	exit(EXIT_FAILURE);
+}
+
+unsigned int probe_io_size(int fd) {
+	struct usb_raw_ep_io *io = alloc_bulk_io(EP_IO_SIZE_PROBE_MAX);
+	unsigned int good = 0, bad;
+
+	for (bad = 1; bad <= EP_IO_SIZE_PROBE_MAX; bad *= 2) {
+		if (!io_size_accepted(fd, io, bad))
+			break;
+		good = bad;
+	}
+	if (bad > EP_IO_SIZE_PROBE_MAX)
+		bad = EP_IO_SIZE_PROBE_MAX + 1;
+	while (bad - good > 1) {
+		unsigned int mid = good + (bad - good) / 2;
+		if (io_size_accepted(fd, io, mid))
+			good = mid;
+		else
+			bad = mid;
+	}
+
+	free(io);
+	return good;
+}
+
+// Called on the first connect, when the UDC is bound and before any
+// endpoints are enabled.
+void setup_io_size(int fd) {
+	if (bulk_in_pattern)
+		return;
+
+	unsigned int max = probe_io_size(fd);
+	if (io_size_probe_only) {
+		printf("%u\n", max);
+		exit(EXIT_SUCCESS);
+	}
+	if (!quiet)
+		printf("max transfer size: %u\n", max);
+	if (io_size_max)
+		bulk_io_size = max;
+	if (bulk_io_size > max) {
+		fprintf(stderr, "transfer size %u exceeds the maximum of %u\n",
+				bulk_io_size, max);
+		exit(EXIT_FAILURE);
+	}
+
+	bulk_in_pattern = alloc_bulk_io(bulk_io_size);
+	fill_pattern(&bulk_in_pattern->data[0], bulk_io_size, bulk_max_packet);
+}
+
 int ep_bulk_out = -1;
 int ep_bulk_in = -1;
 int ep_int_out = -1;
 int ep_int_in = -1;
+int ep_iso_out = -1;
+int ep_iso_in = -1;
 
 pthread_t ep_bulk_out_thread;
 pthread_t ep_bulk_in_thread;
 pthread_t ep_int_out_thread;
 pthread_t ep_int_in_thread;
+pthread_t ep_iso_out_thread;
+pthread_t ep_iso_in_thread;
+
+// Bulk endpoints are halted (or wedged) every halt_every transfers, see
+// haltrec. After a halt, the host clears it with CLEAR_FEATURE, which the
+// UDC handles. A wedged endpoint stays halted until the host also sends
+// VENDOR_REQ_UNWEDGE, like the mass storage reset recovery. Raw Gadget
+// can't clear a halt while a transfer is queued, so the endpoint worker
+// doesn't submit anything until then.
+unsigned int halt_every = 0;
+bool halt_wedge = false;
+
+atomic_bool ep_wedged[STATS_NUM];
+sem_t ep_unwedged[STATS_NUM];
+
+// Returns true if the endpoint got wedged.
+bool halt_maybe(int fd, int ep, enum stats_id id) {
+	uint64_t transfers = atomic_load_explicit(&ep_stats[id].transfers,
+						memory_order_relaxed);
+
+	if (!halt_every || transfers % halt_every)
+		return false;
+	if (halt_wedge) {
+		atomic_store(&ep_wedged[id], true);
+		usb_raw_ep_set_wedge(fd, ep);
+	} else {
+		usb_raw_ep_set_halt(fd, ep);
+	}
+	trace(id, TRACE_HALT, ep, halt_wedge);
+	return halt_wedge;
+}
+
+// Returns false if the endpoint wasn't wedged.
+bool unwedge(int fd, int ep, enum stats_id id) {
+	if (!atomic_load(&ep_wedged[id]))
+		return false;
+	usb_raw_ep_clear_halt(fd, ep);
+	atomic_store(&ep_wedged[id], false);
+	sem_post(&ep_unwedged[id]);
+	return true;
+}
 
 void *ep_bulk_out_loop(void *arg) {
 	int fd = (int)(long)arg;
-	struct usb_raw_bulk_io io;
+	struct usb_raw_ep_io *io = alloc_bulk_io(bulk_io_size);
 
-	while (true) {
-		assert(ep_bulk_out != -1);
-		io.inner.ep = ep_bulk_out;
-		io.inner.flags = 0;
-		io.inner.length = sizeof(io.data);
+	assert(ep_bulk_out != -1);
+	io->ep = ep_bulk_out;
+	io->flags = 0;
 
-		int rv = usb_raw_ep_read(fd, (struct usb_raw_ep_io *)&io);
-		printf("bulk_out: read %d bytes\n", rv);
+	while (true) {
+		io->length = bulk_io_size;
+
+		int rv = usb_raw_ep_read(fd, io);
+		stats_transfer(STATS_BULK_OUT, rv);
+		verify_transfer(STATS_BULK_OUT, &io->data[0],
+				&bulk_in_pattern->data[0], rv, bulk_max_packet);
+		if (halt_maybe(fd, ep_bulk_out, STATS_BULK_OUT))
+			sem_wait(&ep_unwedged[STATS_BULK_OUT]);
+		if (log_verbose())
+			printf("bulk_out: read %d bytes\n", rv);
 	}
 
 	return NULL;
@@ -703,19 +1522,20 @@ void *ep_bulk_out_loop(void *arg) {
 
 void *ep_bulk_in_loop(void *arg) {
 	int fd = (int)(long)arg;
-	struct usb_raw_bulk_io io;
+	struct usb_raw_ep_io *io = bulk_in_pattern;
 
-	while (true) {
-		assert(ep_bulk_in != -1);
-		io.inner.ep = ep_bulk_in;
-		io.inner.flags = 0;
-		io.inner.length = sizeof(io.data);
+	assert(ep_bulk_in != -1);
+	io->ep = ep_bulk_in;
+	io->flags = 0;
+	io->length = bulk_io_size;
 
-		for (int i = 0; i < sizeof(io.data); i++)
-			io.data[i] = (i % EP_MAX_PACKET_BULK) % 63;
-
-		int rv = usb_raw_ep_write(fd, (struct usb_raw_ep_io *)&io);
-		printf("bulk_in: wrote %d bytes\n", rv);
+	while (true) {
+		int rv = usb_raw_ep_write(fd, io);
+		stats_transfer(STATS_BULK_IN, rv);
+		if (halt_maybe(fd, ep_bulk_in, STATS_BULK_IN))
+			sem_wait(&ep_unwedged[STATS_BULK_IN]);
+		if (log_verbose())
+			printf("bulk_in: wrote %d bytes\n", rv);
 	}
 
 	return NULL;
@@ -725,14 +1545,19 @@ void *ep_int_out_loop(void *arg) {
 	int fd = (int)(long)arg;
 	struct usb_raw_int_io io;
 
+	assert(ep_int_out != -1);
+	io.inner.ep = ep_int_out;
+	io.inner.flags = 0;
+
 	while (true) {
-		assert(ep_int_out != -1);
-		io.inner.ep = ep_int_out;
-		io.inner.flags = 0;
 		io.inner.length = sizeof(io.data);
 
 		int rv = usb_raw_ep_read(fd, (struct usb_raw_ep_io *)&io);
-		printf("int_out: read %d bytes\n", rv);
+		stats_transfer(STATS_INT_OUT, rv);
+		verify_transfer(STATS_INT_OUT, &io.data[0],
+				&int_in_pattern.data[0], rv, EP_MAX_PACKET_INT);
+		if (log_verbose())
+			printf("int_out: read %d bytes\n", rv);
 	}
 
 	return NULL;
@@ -740,26 +1565,471 @@ void *ep_int_out_loop(void *arg) {
 
 void *ep_int_in_loop(void *arg) {
 	int fd = (int)(long)arg;
-	struct usb_raw_int_io io;
+	struct usb_raw_int_io *io = &int_in_buffer;
+
+	assert(ep_int_in != -1);
+	io->inner.ep = ep_int_in;
+	io->inner.flags = 0;
+	io->inner.length = sizeof(io->data);
+
+	while (true) {
+		if (int_timestamps)
+			stamp_int_report(io);
+		int rv = usb_raw_ep_write(fd, (struct usb_raw_ep_io *)io);
+		stats_transfer(STATS_INT_IN, rv);
+		if (log_verbose())
+			printf("int_in: wrote %d bytes\n", rv);
+	}
+
+	return NULL;
+}
+
+// Iso endpoints move one packet per request, the device runs at high speed.
+
+void *ep_iso_out_loop(void *arg) {
+	int fd = (int)(long)arg;
+	struct usb_raw_iso_io io;
+
+	assert(ep_iso_out != -1);
+	io.inner.ep = ep_iso_out;
+	io.inner.flags = 0;
 
 	while (true) {
-		assert(ep_int_in != -1);
-		io.inner.ep = ep_int_in;
-		io.inner.flags = 0;
 		io.inner.length = sizeof(io.data);
 
-		for (int i = 0; i < sizeof(io.data); i++)
-			io.data[i] = (i % EP_MAX_PACKET_INT) % 63;
+		int rv = usb_raw_ep_read(fd, (struct usb_raw_ep_io *)&io);
+		stats_transfer(STATS_ISO_OUT, rv);
+		if (log_verbose())
+			printf("iso_out: read %d bytes\n", rv);
+	}
+
+	return NULL;
+}
+
+void *ep_iso_in_loop(void *arg) {
+	int fd = (int)(long)arg;
+	struct usb_raw_iso_io *io = &iso_in_pattern;
+
+	assert(ep_iso_in != -1);
+	io->inner.ep = ep_iso_in;
+	io->inner.flags = 0;
+	io->inner.length = sizeof(io->data);
 
-		int rv = usb_raw_ep_write(fd, (struct usb_raw_ep_io *)&io);
-		printf("int_in: wrote %d bytes\n", rv);
+	while (true) {
+		int rv = usb_raw_ep_write(fd, (struct usb_raw_ep_io *)io);
+		stats_transfer(STATS_ISO_IN, rv);
+		if (log_verbose())
+			printf("iso_in: wrote %d bytes\n", rv);
+	}
+
+	return NULL;
+}
+
+#ifdef GADGET_EPOLL
+
+// Raw Gadget doesn't support poll() nor nonblocking I/O, so every blocking
+// ioctl is issued by a helper thread, which does nothing but the ioctl and
+// then signals the completion through an eventfd. All the gadget logic runs
+// in a single event loop that waits for those eventfds with epoll.
+
+struct io_channel {
+	const char		*name;
+	int			fd;
+	unsigned long		request;
+	void			*arg;
+	int			rv;
+	int			error;
+	bool			busy;
+	int			submit_efd;
+	int			complete_efd;
+	pthread_t		thread;
+	void			(*complete)(struct io_channel *ch);
+};
+
+void *io_channel_loop(void *arg) {
+	struct io_channel *ch = (struct io_channel *)arg;
+	uint64_t count;
+
+	while (true) {
+		if (read(ch->submit_efd, &count, sizeof(count)) < 0) {
+			perror("read(submit_efd)");
+			exit(EXIT_FAILURE);
+		}
+		ch->rv = ioctl(ch->fd, ch->request, ch->arg);
+		ch->error = (ch->rv < 0) ? errno : 0;
+		count = 1;
+		if (write(ch->complete_efd, &count, sizeof(count)) < 0) {
+			perror("write(complete_efd)");
+			exit(EXIT_FAILURE);
+		}
 	}
 
 	return NULL;
 }
 
-#define VENDOR_REQ_OUT	0x5b
-#define VENDOR_REQ_IN	0x5c
+int epoll_fd = -1;
+
+void io_channel_init(struct io_channel *ch, const char *name, int fd,
+			void (*complete)(struct io_channel *ch)) {
+	ch->name = name;
+	ch->fd = fd;
+	ch->busy = false;
+	ch->complete = complete;
+	ch->submit_efd = eventfd(0, EFD_CLOEXEC);
+	ch->complete_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (ch->submit_efd < 0 || ch->complete_efd < 0) {
+		perror("eventfd()");
+		exit(EXIT_FAILURE);
+	}
+
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = ch;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ch->complete_efd, &event) < 0) {
+		perror("epoll_ctl()");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_create(&ch->thread, 0, io_channel_loop, ch);
+}
+
+void io_channel_submit(struct io_channel *ch, unsigned long request,
+			void *arg) {
+	uint64_t count = 1;
+
+	assert(!ch->busy);
+	ch->busy = true;
+	ch->request = request;
+	ch->arg = arg;
+	if (write(ch->submit_efd, &count, sizeof(count)) < 0) {
+		perror("write(submit_efd)");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Returns the result of the completed ioctl. Fails the same way the
+// synchronous usb_raw_*() helpers do.
+int io_channel_result(struct io_channel *ch) {
+	if (ch->rv >= 0)
+		return ch->rv;
+	if (ch->error == EINPROGRESS &&
+			ch->request != USB_RAW_IOCTL_EVENT_FETCH) {
+		// Ignore failures caused by the test that halts endpoints.
+		return ch->rv;
+	}
+	errno = ch->error;
+	perror(ch->name);
+	exit(EXIT_FAILURE);
+}
+
+// Each non-control endpoint is a two-state machine: either a transfer is
+// in flight on its channel, or the previous one has completed and the next
+// one is submitted right away.
+
+struct ep_state {
+	struct io_channel	ch;
+	int			*ep;
+	enum stats_id		stats;
+	bool			in;
+	struct usb_raw_ep_io	*io;
+	unsigned int		length;
+	const void		*pattern;	// Expected OUT data.
+	unsigned int		max_packet;	// Of the pattern.
+};
+
+struct usb_raw_int_io int_out_buffer;
+struct usb_raw_iso_io iso_out_buffer;
+
+struct ep_state ep_states[] = {
+	// Bulk buffers are set in ep_states_start().
+	{ .ch = { .name = "bulk_out" }, .ep = &ep_bulk_out,
+	  .stats = STATS_BULK_OUT, .in = false },
+	{ .ch = { .name = "bulk_in" }, .ep = &ep_bulk_in,
+	  .stats = STATS_BULK_IN, .in = true },
+	{ .ch = { .name = "int_out" }, .ep = &ep_int_out,
+	  .stats = STATS_INT_OUT, .in = false,
+	  .io = (struct usb_raw_ep_io *)&int_out_buffer,
+	  .length = EP_MAX_PACKET_INT, .pattern = &int_in_pattern.data[0],
+	  .max_packet = EP_MAX_PACKET_INT },
+	{ .ch = { .name = "int_in" }, .ep = &ep_int_in,
+	  .stats = STATS_INT_IN, .in = true,
+	  .io = (struct usb_raw_ep_io *)&int_in_buffer,
+	  .length = EP_MAX_PACKET_INT },
+	{ .ch = { .name = "iso_out" }, .ep = &ep_iso_out,
+	  .stats = STATS_ISO_OUT, .in = false,
+	  .io = (struct usb_raw_ep_io *)&iso_out_buffer,
+	  .length = EP_MAX_PACKET_ISO_HS },
+	{ .ch = { .name = "iso_in" }, .ep = &ep_iso_in,
+	  .stats = STATS_ISO_IN, .in = true,
+	  .io = (struct usb_raw_ep_io *)&iso_in_pattern,
+	  .length = EP_MAX_PACKET_ISO_HS },
+};
+
+#define EP_STATES_NUM (sizeof(ep_states) / sizeof(ep_states[0]))
+
+void ep_state_submit(struct ep_state *state) {
+	if (int_timestamps && state->stats == STATS_INT_IN)
+		stamp_int_report((struct usb_raw_int_io *)state->io);
+	state->io->ep = *state->ep;
+	state->io->flags = 0;
+	state->io->length = state->length;
+	io_channel_submit(&state->ch, state->in ? USB_RAW_IOCTL_EP_WRITE :
+					USB_RAW_IOCTL_EP_READ, state->io);
+}
+
+void ep_state_complete(struct io_channel *ch) {
+	struct ep_state *state = (struct ep_state *)ch;
+
+	int rv = io_channel_result(ch);
+	stats_transfer(state->stats, rv);
+	if (state->pattern)
+		verify_transfer(state->stats, &state->io->data[0],
+					state->pattern, rv, state->max_packet);
+	// Resubmitted by ep_states_start() on VENDOR_REQ_UNWEDGE.
+	if ((state->stats == STATS_BULK_OUT || state->stats == STATS_BULK_IN) &&
+			halt_maybe(ch->fd, *state->ep, state->stats))
+		return;
+	if (log_verbose())
+		printf("%s: %s %d bytes\n", ch->name,
+				state->in ? "wrote" : "read", rv);
+	ep_state_submit(state);
+}
+
+void ep_states_init(int fd) {
+	for (int i = 0; i < EP_STATES_NUM; i++)
+		io_channel_init(&ep_states[i].ch, ep_states[i].ch.name, fd,
+							ep_state_complete);
+}
+
+// Starts all enabled endpoints that aren't running yet.
+void ep_states_start() {
+	if (!ep_states[0].io) {
+		ep_states[0].io = alloc_bulk_io(bulk_io_size);
+		ep_states[0].length = bulk_io_size;
+		ep_states[0].pattern = &bulk_in_pattern->data[0];
+		ep_states[0].max_packet = bulk_max_packet;
+		ep_states[1].io = bulk_in_pattern;
+		ep_states[1].length = bulk_io_size;
+	}
+	for (int i = 0; i < EP_STATES_NUM; i++) {
+		if (*ep_states[i].ep == -1 || ep_states[i].ch.busy ||
+				atomic_load(&ep_wedged[ep_states[i].stats]))
+			continue;
+		ep_state_submit(&ep_states[i]);
+	}
+}
+
+#endif
+
+// Enables iso endpoints on the first switch to ALT_ISO.
+bool iso_start(int fd) {
+	if (ep_iso_out != -1 && ep_iso_in != -1)
+		return true;
+	if (!iso_available)
+		return false;
+
+	// Not all UDCs that advertise iso endpoints support them.
+	ep_iso_out = usb_raw_ep_enable_optional(fd, &usb_endpoint_iso_out);
+	ep_iso_in = usb_raw_ep_enable_optional(fd, &usb_endpoint_iso_in);
+	if (ep_iso_out < 0 || ep_iso_in < 0) {
+		iso_available = false;
+		return false;
+	}
+	printf("iso_out: ep = #%d\n", ep_iso_out);
+	printf("iso_in: ep = #%d\n", ep_iso_in);
+
+#ifdef GADGET_EPOLL
+	ep_states_start();
+#else
+	pthread_create(&ep_iso_out_thread, 0,
+			ep_iso_out_loop, (void *)(long)fd);
+	pthread_create(&ep_iso_in_thread, 0,
+			ep_iso_in_loop, (void *)(long)fd);
+#endif
+	return true;
+}
+
+/*----------------------------------------------------------------------*/
+
+// ioctl benchmark: once the device is configured and SET_CONFIGURATION is
+// acknowledged, so that enumeration is over, measures the cost of the Raw
+// Gadget ioctls that complete without bus traffic, issued by a growing
+// number of threads at once to show contention on the device lock.
+// Endpoint workers aren't started, as Raw Gadget refuses to halt or disable
+// an endpoint with a transfer in flight.
+
+#define IOCTL_BENCH_THREADS_DEFAULT	4
+
+unsigned int ioctl_bench_iterations = 0;
+int ioctl_bench_threads = IOCTL_BENCH_THREADS_DEFAULT;
+
+// Threads doing endpoint ioctls get an endpoint each, round robin.
+struct ioctl_bench_ep {
+	int				*ep;
+	struct usb_endpoint_descriptor	*desc;
+};
+
+struct ioctl_bench_ep ioctl_bench_eps[] = {
+	{ &ep_bulk_out, &usb_endpoint_bulk_out },
+	{ &ep_bulk_in, &usb_endpoint_bulk_in },
+	{ &ep_int_out, &usb_endpoint_int_out },
+	{ &ep_int_in, &usb_endpoint_int_in },
+};
+
+#define IOCTL_BENCH_EPS_NUM \
+	(sizeof(ioctl_bench_eps) / sizeof(ioctl_bench_eps[0]))
+
+struct ioctl_bench_thread {
+	int			fd;
+	struct ioctl_bench_ep	*ep;
+	int			(*call)(struct ioctl_bench_thread *t);
+	pthread_barrier_t	*barrier;
+	uint64_t		start;
+	uint64_t		end;
+	unsigned int		errors;
+};
+
+// Each call returns the number of ioctls it did.
+
+int ioctl_bench_invalid(struct ioctl_bench_thread *t) {
+	// Only the syscall and the ioctl dispatch.
+	if (ioctl(t->fd, _IO('U', 0xff), 0) >= 0 || errno != EINVAL)
+		t->errors++;
+	return 1;
+}
+
+int ioctl_bench_eps_info(struct ioctl_bench_thread *t) {
+	struct usb_raw_eps_info info;
+
+	if (ioctl(t->fd, USB_RAW_IOCTL_EPS_INFO, &info) < 0)
+		t->errors++;
+	return 1;
+}
+
+int ioctl_bench_vbus_draw(struct ioctl_bench_thread *t) {
+	if (ioctl(t->fd, USB_RAW_IOCTL_VBUS_DRAW, usb_config.bMaxPower) < 0)
+		t->errors++;
+	return 1;
+}
+
+int ioctl_bench_halt(struct ioctl_bench_thread *t) {
+	if (ioctl(t->fd, USB_RAW_IOCTL_EP_SET_HALT, *t->ep->ep) < 0)
+		t->errors++;
+	if (ioctl(t->fd, USB_RAW_IOCTL_EP_CLEAR_HALT, *t->ep->ep) < 0)
+		t->errors++;
+	return 2;
+}
+
+int ioctl_bench_enable(struct ioctl_bench_thread *t) {
+	if (ioctl(t->fd, USB_RAW_IOCTL_EP_DISABLE, *t->ep->ep) < 0)
+		t->errors++;
+	int rv = ioctl(t->fd, USB_RAW_IOCTL_EP_ENABLE, t->ep->desc);
+	if (rv < 0) {
+		perror("ioctl(USB_RAW_IOCTL_EP_ENABLE)");
+		exit(EXIT_FAILURE);
+	}
+	*t->ep->ep = rv;
+	return 2;
+}
+
+struct ioctl_bench_op {
+	const char	*name;
+	int		(*call)(struct ioctl_bench_thread *t);
+	bool		own_ep;		// Threads can't share endpoints.
+};
+
+struct ioctl_bench_op ioctl_bench_ops[] = {
+	{ "invalid", ioctl_bench_invalid, false },
+	{ "EPS_INFO", ioctl_bench_eps_info, false },
+	{ "VBUS_DRAW", ioctl_bench_vbus_draw, false },
+	{ "SET/CLEAR_HALT", ioctl_bench_halt, false },
+	{ "DISABLE/ENABLE", ioctl_bench_enable, true },
+};
+
+void *ioctl_bench_loop(void *arg) {
+	struct ioctl_bench_thread *t = (struct ioctl_bench_thread *)arg;
+	int calls = 0;
+
+	pthread_barrier_wait(t->barrier);
+	t->start = now_ns();
+	for (unsigned int i = 0; i < ioctl_bench_iterations; i++)
+		calls += t->call(t);
+	t->end = now_ns();
+
+	return (void *)(long)calls;
+}
+
+void ioctl_bench_run(int fd, struct ioctl_bench_op *op, int num) {
+	struct ioctl_bench_thread threads[num];
+	pthread_t ids[num];
+	pthread_barrier_t barrier;
+	uint64_t start = UINT64_MAX, end = 0, busy = 0, calls = 0;
+	unsigned int errors = 0;
+
+	pthread_barrier_init(&barrier, NULL, num);
+	for (int i = 0; i < num; i++) {
+		threads[i].fd = fd;
+		threads[i].ep = &ioctl_bench_eps[i % IOCTL_BENCH_EPS_NUM];
+		threads[i].call = op->call;
+		threads[i].barrier = &barrier;
+		threads[i].errors = 0;
+		pthread_create(&ids[i], 0, ioctl_bench_loop, &threads[i]);
+	}
+	for (int i = 0; i < num; i++) {
+		void *rv;
+
+		pthread_join(ids[i], &rv);
+		calls += (long)rv;
+		busy += threads[i].end - threads[i].start;
+		errors += threads[i].errors;
+		if (threads[i].start < start)
+			start = threads[i].start;
+		if (threads[i].end > end)
+			end = threads[i].end;
+	}
+	pthread_barrier_destroy(&barrier);
+
+	printf("%-16s %3d threads: %9.1f ns/call, %9.3f Mcalls/s, "
+		"%u errors\n", op->name, num, (double)busy / calls,
+		calls * 1e3 / (end - start), errors);
+}
+
+void *ioctl_bench(void *arg) {
+	int fd = (int)(long)arg;
+
+	for (int i = 0; i < sizeof(ioctl_bench_ops) /
+				sizeof(ioctl_bench_ops[0]); i++) {
+		struct ioctl_bench_op *op = &ioctl_bench_ops[i];
+
+		for (int num = 1; ; num *= 2) {
+			if (num > ioctl_bench_threads)
+				num = ioctl_bench_threads;
+			if (op->own_ep && num > IOCTL_BENCH_EPS_NUM)
+				break;
+			ioctl_bench_run(fd, op, num);
+			if (num == ioctl_bench_threads)
+				break;
+		}
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+void ioctl_bench_start(int fd) {
+	static bool started = false;
+	pthread_t thread;
+
+	if (started)
+		return;
+	started = true;
+	pthread_create(&thread, 0, ioctl_bench, (void *)(long)fd);
+}
+
+/*----------------------------------------------------------------------*/
+
+#define VENDOR_REQ_OUT		0x5b
+#define VENDOR_REQ_IN		0x5c
+#define VENDOR_REQ_UNWEDGE	0x5d	// wIndex: endpoint address.
 
 #define VENDOR_BUFFER_SIZE 256
 
@@ -821,10 +2091,10 @@ bool ep0_request(int fd, struct usb_raw_control_event *event,
 				io->inner.length = 4;
 				return true;
 			case USB_DT_BOS:
-				if (BCD_USB < 0x0201)
+				if (bcd_usb < 0x0201)
 					return false;
-				memcpy(&io->data[0], &usb_bos, sizeof(usb_bos));
-				io->inner.length = sizeof(usb_bos);
+				io->inner.length = build_bos(&io->data[0],
+							sizeof(io->data));
 				return true;
 			default:
 				printf("fail: no response\n");
@@ -834,30 +2104,45 @@ bool ep0_request(int fd, struct usb_raw_control_event *event,
 		case USB_REQ_SET_CONFIGURATION:
 			ep_bulk_out = usb_raw_ep_enable(fd,
 						&usb_endpoint_bulk_out);
-			printf("bulk_out: ep = #%d\n", ep_bulk_out);
 			ep_bulk_in = usb_raw_ep_enable(fd,
 						&usb_endpoint_bulk_in);
-			printf("bulk_in: ep = #%d\n", ep_bulk_in);
 			ep_int_out = usb_raw_ep_enable(fd,
 						&usb_endpoint_int_out);
-			printf("int_out: ep = #%d\n", ep_int_out);
 			ep_int_in = usb_raw_ep_enable(fd,
 						&usb_endpoint_int_in);
-			printf("int_in: ep = #%d\n", ep_int_in);
-			pthread_create(&ep_bulk_out_thread, 0,
+			if (!quiet) {
+				printf("bulk_out: ep = #%d\n", ep_bulk_out);
+				printf("bulk_in: ep = #%d\n", ep_bulk_in);
+				printf("int_out: ep = #%d\n", ep_int_out);
+				printf("int_in: ep = #%d\n", ep_int_in);
+			}
+			// The enumeration benchmark closes the device right
+			// away, and the ioctl benchmark doesn't use transfers,
+			// it's started once the request is acknowledged.
+			if (!enum_cycle && !ioctl_bench_iterations) {
+#ifdef GADGET_EPOLL
+				ep_states_start();
+#else
+				pthread_create(&ep_bulk_out_thread, 0,
 					ep_bulk_out_loop, (void *)(long)fd);
-			pthread_create(&ep_bulk_in_thread, 0,
+				pthread_create(&ep_bulk_in_thread, 0,
 					ep_bulk_in_loop, (void *)(long)fd);
-			pthread_create(&ep_int_out_thread, 0,
+				pthread_create(&ep_int_out_thread, 0,
 					ep_int_out_loop, (void *)(long)fd);
-			pthread_create(&ep_int_in_thread, 0,
+				pthread_create(&ep_int_in_thread, 0,
 					ep_int_in_loop, (void *)(long)fd);
+#endif
+			}
 			usb_raw_vbus_draw(fd, usb_config.bMaxPower);
 			usb_raw_configure(fd);
 			io->inner.length = 0;
 			return true;
 		case USB_REQ_SET_INTERFACE:
-			// TODO: enable/disable endpoints, etc.
+			if (event->ctrl.wValue >= USB_INTERFACE_ALTS_NUM)
+				return false;
+			if (event->ctrl.wValue == ALT_ISO && !iso_start(fd))
+				return false;
+			// TODO: disable endpoints not in the new altsetting.
 			alt_index = event->ctrl.wValue;
 			io->inner.length = 0;
 			return true;
@@ -893,6 +2178,21 @@ bool ep0_request(int fd, struct usb_raw_control_event *event,
 						event->ctrl.wLength);
 			io->inner.length = event->ctrl.wLength;
 			return true;
+		case VENDOR_REQ_UNWEDGE:
+			assert(!(event->ctrl.bRequestType & USB_DIR_IN));
+			if (event->ctrl.wIndex ==
+					usb_endpoint_bulk_out.bEndpointAddress)
+				unwedge(fd, ep_bulk_out, STATS_BULK_OUT);
+			else if (event->ctrl.wIndex ==
+					usb_endpoint_bulk_in.bEndpointAddress)
+				unwedge(fd, ep_bulk_in, STATS_BULK_IN);
+			else
+				return false;
+#ifdef GADGET_EPOLL
+			ep_states_start();
+#endif
+			io->inner.length = 0;
+			return true;
 		default:
 			printf("fail: no response\n");
 			exit(EXIT_FAILURE);
@@ -904,6 +2204,7 @@ bool ep0_request(int fd, struct usb_raw_control_event *event,
 	}
 }
 
+// In the enumeration benchmark returns once SET_CONFIGURATION is handled.
 void ep0_loop(int fd) {
 	bool done = false;
 	while (!done) {
@@ -912,14 +2213,30 @@ void ep0_loop(int fd) {
 		event.inner.length = sizeof(event.ctrl);
 
 		usb_raw_event_fetch(fd, (struct usb_raw_event *)&event);
-		log_event((struct usb_raw_event *)&event);
+		stats_event(&event);
+		if (!quiet && log_verbose())
+			log_event((struct usb_raw_event *)&event);
 
-		if (event.inner.type == USB_RAW_EVENT_CONNECT)
+		if (event.inner.type == USB_RAW_EVENT_CONNECT) {
+			if (enum_cycle)
+				enum_cycle->connected = now_ns();
 			process_eps_info(fd);
+			setup_io_size(fd);
+		}
 
 		if (event.inner.type != USB_RAW_EVENT_CONTROL)
 			continue;
 
+		bool standard = (event.ctrl.bRequestType & USB_TYPE_MASK) ==
+							USB_TYPE_STANDARD;
+		bool set_config = standard &&
+			event.ctrl.bRequest == USB_REQ_SET_CONFIGURATION;
+		if (enum_cycle && set_config)
+			enum_cycle->set_config = now_ns();
+		if (enum_cycle && standard &&
+				event.ctrl.bRequest == USB_REQ_GET_DESCRIPTOR)
+			enum_cycle->descriptors++;
+
 		struct usb_raw_control_io io;
 		io.inner.ep = 0;
 		io.inner.flags = 0;
@@ -927,7 +2244,9 @@ void ep0_loop(int fd) {
 
 		bool reply = ep0_request(fd, &event, &io);
 		if (!reply) {
-			printf("ep0: stalling\n");
+			if (!quiet && log_verbose())
+				printf("ep0: stalling\n");
+			trace(STATS_EP0, TRACE_STALL, 0, 0);
 			usb_raw_ep0_stall(fd);
 			continue;
 		}
@@ -937,32 +2256,505 @@ void ep0_loop(int fd) {
 		int rv = -1;
 		if (event.ctrl.bRequestType & USB_DIR_IN) {
 			rv = usb_raw_ep0_write(fd, (struct usb_raw_ep_io *)&io);
-			printf("ep0: transferred %d bytes (in)\n", rv);
+			stats_transfer(STATS_EP0, rv);
+			if (!quiet && log_verbose())
+				printf("ep0: transferred %d bytes (in)\n", rv);
 		} else {
 			rv = usb_raw_ep0_read(fd, (struct usb_raw_ep_io *)&io);
-			printf("ep0: transferred %d bytes (out)\n", rv);
+			stats_transfer(STATS_EP0, rv);
+			if (!quiet && log_verbose())
+				printf("ep0: transferred %d bytes (out)\n", rv);
 		}
 
 		if ((event.ctrl.bRequestType & USB_TYPE_MASK) ==
 				USB_TYPE_VENDOR &&
 					event.ctrl.bRequest == VENDOR_REQ_OUT)
 			memcpy(&vendor_buffer[0], &io.data[0], rv);
+
+		if (enum_cycle && set_config) {
+			enum_cycle->acked = now_ns();
+			done = true;
+		}
+		if (ioctl_bench_iterations && set_config && rv >= 0)
+			ioctl_bench_start(fd);
+	}
+}
+
+/*----------------------------------------------------------------------*/
+
+// Enumeration benchmark: repeatedly binds the gadget, waits for the host
+// to configure it, closes Raw Gadget and waits for the host to drop the
+// device. The host side is watched through sysfs, so the benchmark must
+// run on the same machine as the host, which is the case for Dummy UDC.
+
+#define SYSFS_USB_DEVICES	"/sys/bus/usb/devices"
+#define ENUM_TIMEOUT_NS		(5 * 1000000000ull)
+#define ENUM_POLL_US		10
+
+bool sysfs_read(const char *dev, const char *attr, char *buf, int size) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), SYSFS_USB_DEVICES "/%s/%s", dev, attr);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	int rv = read(fd, buf, size - 1);
+	close(fd);
+	if (rv < 0)
+		return false;
+	buf[rv] = 0;
+	return true;
+}
+
+// Looks for a configured host-side device with our VID:PID and stores its
+// sysfs name into dev. Returns false if there's none.
+bool sysfs_find_configured(char *dev, int size) {
+	DIR *dir = opendir(SYSFS_USB_DEVICES);
+	if (!dir) {
+		perror("opendir(" SYSFS_USB_DEVICES ")");
+		exit(EXIT_FAILURE);
+	}
+
+	bool found = false;
+	struct dirent *entry;
+	while (!found && (entry = readdir(dir))) {
+		char buf[16];
+		// Skip ".", ".." and interfaces.
+		if (entry->d_name[0] == '.' || strchr(entry->d_name, ':'))
+			continue;
+		if (!sysfs_read(entry->d_name, "idVendor", buf, sizeof(buf)) ||
+				strtoul(buf, NULL, 16) != USB_VENDOR)
+			continue;
+		if (!sysfs_read(entry->d_name, "idProduct", buf, sizeof(buf)) ||
+				strtoul(buf, NULL, 16) != USB_PRODUCT)
+			continue;
+		if (!sysfs_read(entry->d_name, "bConfigurationValue",
+					buf, sizeof(buf)) || buf[0] == '\n')
+			continue;
+		snprintf(dev, size, "%s", entry->d_name);
+		found = true;
 	}
+
+	closedir(dir);
+	return found;
+}
+
+bool sysfs_exists(const char *dev) {
+	char buf[16];
+	return sysfs_read(dev, "idVendor", buf, sizeof(buf));
+}
+
+void enum_wait(const char *what, struct enum_cycle *cycle) {
+	if (now_ns() - cycle->start > ENUM_TIMEOUT_NS) {
+		fprintf(stderr, "enum: timed out waiting for %s\n", what);
+		exit(EXIT_FAILURE);
+	}
+	usleep(ENUM_POLL_US);
+}
+
+int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+void enum_print_phase(const char *name, uint64_t *samples, int n) {
+	uint64_t sum = 0;
+	for (int i = 0; i < n; i++)
+		sum += samples[i];
+	qsort(samples, n, sizeof(samples[0]), compare_u64);
+	// Nearest-rank percentiles.
+	printf("%-12s mean %9.1f us, p50 %9.1f us, p99 %9.1f us, "
+		"max %9.1f us\n", name, sum / 1e3 / n,
+		samples[(n + 1) / 2 - 1] / 1e3,
+		samples[(99 * n + 99) / 100 - 1] / 1e3,
+		samples[n - 1] / 1e3);
+}
+
+void enum_bench(const char *device, const char *driver, int cycles) {
+	struct enum_cycle *results = calloc(cycles, sizeof(results[0]));
+	uint64_t *samples = calloc(cycles, sizeof(samples[0]));
+	char dev[NAME_MAX + 1];
+
+	if (!results || !samples) {
+		perror("calloc()");
+		exit(EXIT_FAILURE);
+	}
+	if (sysfs_find_configured(&dev[0], sizeof(dev))) {
+		fprintf(stderr, "enum: %04x:%04x is already connected as %s\n",
+				USB_VENDOR, USB_PRODUCT, &dev[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	quiet = true;
+	for (int i = 0; i < cycles; i++) {
+		struct enum_cycle *cycle = &results[i];
+
+		ep_bulk_out = ep_bulk_in = ep_int_out = ep_int_in = -1;
+		ep_iso_out = ep_iso_in = -1;
+		alt_index = 0;
+		enum_cycle = cycle;
+
+		cycle->start = now_ns();
+		int fd = usb_raw_open();
+		usb_raw_init(fd, speed, driver, device);
+		usb_raw_run(fd);
+		cycle->bound = now_ns();
+
+		ep0_loop(fd);
+
+		while (!sysfs_find_configured(&dev[0], sizeof(dev)))
+			enum_wait("configuration", cycle);
+		cycle->configured = now_ns();
+
+		close(fd);
+		while (sysfs_exists(&dev[0]))
+			enum_wait("disconnect", cycle);
+		cycle->gone = now_ns();
+
+		enum_cycle = NULL;
+	}
+
+	uint64_t total = 0;
+	unsigned descriptors = 0;
+	for (int i = 0; i < cycles; i++) {
+		total += results[i].gone - results[i].start;
+		descriptors += results[i].descriptors;
+	}
+	printf("enum: %d cycles, %.1f cycles/s, %.1f descriptor requests "
+		"per cycle\n", cycles, cycles / (total / 1e9),
+		(double)descriptors / cycles);
+
+#define ENUM_PHASE(name, from, to)					\
+	do {								\
+		for (int i = 0; i < cycles; i++)			\
+			samples[i] = results[i].to - results[i].from;	\
+		enum_print_phase(name, samples, cycles);		\
+	} while (0)
+
+	ENUM_PHASE("bind", start, bound);
+	ENUM_PHASE("reset", bound, connected);
+	ENUM_PHASE("descriptors", connected, set_config);
+	ENUM_PHASE("set_config", set_config, acked);
+	ENUM_PHASE("host", acked, configured);
+	ENUM_PHASE("teardown", configured, gone);
+	ENUM_PHASE("total", start, gone);
+
+#undef ENUM_PHASE
+
+	free(samples);
+	free(results);
+}
+
+#ifdef GADGET_EPOLL
+
+// ep0 is driven by two channels: one fetches events, the other one does
+// the data stage of a control request. Only one of them is busy at a time.
+
+struct io_channel ep0_event_ch;
+struct io_channel ep0_data_ch;
+
+struct usb_raw_control_event ep0_event;
+struct usb_raw_control_io ep0_io;
+
+void ep0_fetch_event() {
+	ep0_event.inner.type = 0;
+	ep0_event.inner.length = sizeof(ep0_event.ctrl);
+	io_channel_submit(&ep0_event_ch, USB_RAW_IOCTL_EVENT_FETCH,
+							&ep0_event);
+}
+
+void ep0_event_complete(struct io_channel *ch) {
+	io_channel_result(ch);
+	stats_event(&ep0_event);
+	if (log_verbose())
+		log_event((struct usb_raw_event *)&ep0_event);
+
+	if (ep0_event.inner.type == USB_RAW_EVENT_CONNECT) {
+		process_eps_info(ch->fd);
+		setup_io_size(ch->fd);
+	}
+
+	if (ep0_event.inner.type != USB_RAW_EVENT_CONTROL) {
+		ep0_fetch_event();
+		return;
+	}
+
+	ep0_io.inner.ep = 0;
+	ep0_io.inner.flags = 0;
+	ep0_io.inner.length = 0;
+
+	bool reply = ep0_request(ch->fd, &ep0_event, &ep0_io);
+	if (!reply) {
+		if (!quiet && log_verbose())
+			printf("ep0: stalling\n");
+		trace(STATS_EP0, TRACE_STALL, 0, 0);
+		usb_raw_ep0_stall(ch->fd);
+		ep0_fetch_event();
+		return;
+	}
+
+	if (ep0_event.ctrl.wLength < ep0_io.inner.length)
+		ep0_io.inner.length = ep0_event.ctrl.wLength;
+	if (ep0_event.ctrl.bRequestType & USB_DIR_IN)
+		io_channel_submit(&ep0_data_ch, USB_RAW_IOCTL_EP0_WRITE,
+								&ep0_io);
+	else
+		io_channel_submit(&ep0_data_ch, USB_RAW_IOCTL_EP0_READ,
+								&ep0_io);
+}
+
+void ep0_data_complete(struct io_channel *ch) {
+	int rv = io_channel_result(ch);
+	stats_transfer(STATS_EP0, rv);
+	if (log_verbose())
+		printf("ep0: transferred %d bytes (%s)\n", rv,
+			(ep0_event.ctrl.bRequestType & USB_DIR_IN) ?
+							"in" : "out");
+
+	if ((ep0_event.ctrl.bRequestType & USB_TYPE_MASK) ==
+			USB_TYPE_VENDOR &&
+				ep0_event.ctrl.bRequest == VENDOR_REQ_OUT)
+		memcpy(&vendor_buffer[0], &ep0_io.data[0], rv);
+
+	if (ioctl_bench_iterations && rv >= 0 &&
+			(ep0_event.ctrl.bRequestType & USB_TYPE_MASK) ==
+				USB_TYPE_STANDARD &&
+			ep0_event.ctrl.bRequest == USB_REQ_SET_CONFIGURATION)
+		ioctl_bench_start(ch->fd);
+
+	ep0_fetch_event();
+}
+
+#define EPOLL_EVENTS_MAX 8
+
+void event_loop(int fd) {
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		perror("epoll_create1()");
+		exit(EXIT_FAILURE);
+	}
+
+	io_channel_init(&ep0_event_ch, "ep0_event", fd, ep0_event_complete);
+	io_channel_init(&ep0_data_ch, "ep0_data", fd, ep0_data_complete);
+	ep_states_init(fd);
+
+	ep0_fetch_event();
+
+	while (true) {
+		struct epoll_event events[EPOLL_EVENTS_MAX];
+
+		int n = epoll_wait(epoll_fd, &events[0], EPOLL_EVENTS_MAX, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait()");
+			exit(EXIT_FAILURE);
+		}
+
+		for (int i = 0; i < n; i++) {
+			struct io_channel *ch =
+				(struct io_channel *)events[i].data.ptr;
+			uint64_t count;
+
+			if (read(ch->complete_efd, &count, sizeof(count)) < 0)
+				continue;
+			ch->busy = false;
+			ch->complete(ch);
+		}
+	}
+}
+
+#endif
+
+void usage(const char *name) {
+	fprintf(stderr,
+		"usage: %s [options] [DEVICE [DRIVER]]\n"
+		"Options:\n"
+		"\t-f, --fast\t\tdon't log transfers, move --io-size "
+		"bytes per bulk ioctl\n"
+		"\t-v, --verbose\t\tlog every transfer and ep0 event, "
+		"default unless --fast\n"
+		"\t-n, --no-verbose\tdon't, even without --fast\n"
+		"\t-N, --no-verify\t\tdon't check bulk and interrupt OUT "
+		"data, for usbtest with pattern=0\n"
+		"\t-T, --timestamps\ttimestamp interrupt IN reports, "
+		"for intlat\n"
+		"\t-H, --halt-every N\thalt bulk endpoints every N "
+		"transfers, for haltrec\n"
+		"\t-w, --wedge\t\twedge them instead\n"
+		"\t-s, --io-size N\t\tbulk transfer size in fast mode, "
+		"default %d, 'max' for the largest one Raw Gadget accepts\n"
+		"\t-P, --probe-io-size\tprint the largest transfer size "
+		"Raw Gadget accepts and exit\n"
+		"\t-e, --enum-cycles N\trun N connect/enumerate/disconnect "
+		"cycles and report their timings\n"
+		"\t-I, --ioctl-bench N\tonce configured, time N calls of "
+		"each control ioctl per thread and exit\n"
+		"\t-t, --threads N\t\tup to N threads for --ioctl-bench, "
+		"default %d\n"
+		"\t-S, --speed SPEED\thigh (default) or super\n"
+		"\t-b, --bcd-usb BCD\tbcdUSB, default 0x%04x (0x%04x for "
+		"super)\n"
+		"\t-m, --max-burst N\tbulk bMaxBurst + 1 for super speed, "
+		"default %d, at most 16\n"
+		"Signals:\n"
+		"\tSIGUSR1\t\t\tdump transfer counters and the trace of the "
+		"last %d transfers and events to stderr\n"
+		"\tSIGUSR2\t\t\ttoggle verbose logging\n",
+		name, EP_IO_SIZE_DEFAULT, IOCTL_BENCH_THREADS_DEFAULT,
+		BCD_USB, BCD_USB_SS,
+		EP_MAX_BURST_SS, TRACE_SIZE);
+	exit(EXIT_FAILURE);
 }
 
 int main(int argc, char **argv) {
 	const char *device = "dummy_udc.0";
 	const char *driver = "dummy_udc";
-	if (argc >= 2)
-		device = argv[1];
-	if (argc >= 3)
-		driver = argv[2];
+	unsigned int io_size = EP_IO_SIZE_DEFAULT;
+	int enum_cycles = 0;
+	enum usb_device_speed new_speed = USB_SPEED_HIGH;
+	unsigned int bcd = 0;
+	int max_burst = EP_MAX_BURST_SS;
+	int verbose_opt = -1;
+
+	static const struct option long_options[] = {
+		{"fast", no_argument, NULL, 'f'},
+		{"verbose", no_argument, NULL, 'v'},
+		{"no-verbose", no_argument, NULL, 'n'},
+		{"no-verify", no_argument, NULL, 'N'},
+		{"timestamps", no_argument, NULL, 'T'},
+		{"halt-every", required_argument, NULL, 'H'},
+		{"wedge", no_argument, NULL, 'w'},
+		{"io-size", required_argument, NULL, 's'},
+		{"probe-io-size", no_argument, NULL, 'P'},
+		{"enum-cycles", required_argument, NULL, 'e'},
+		{"ioctl-bench", required_argument, NULL, 'I'},
+		{"threads", required_argument, NULL, 't'},
+		{"speed", required_argument, NULL, 'S'},
+		{"bcd-usb", required_argument, NULL, 'b'},
+		{"max-burst", required_argument, NULL, 'm'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0},
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "fvnNTH:ws:Pe:I:t:S:b:m:h",
+					long_options, NULL)) != EOF) {
+		switch (opt) {
+		case 'f':
+			fast_mode = true;
+			break;
+		case 'v':
+			verbose_opt = true;
+			break;
+		case 'n':
+			verbose_opt = false;
+			break;
+		case 'N':
+			verify_data = false;
+			break;
+		case 'T':
+			int_timestamps = true;
+			break;
+		case 'H':
+			halt_every = atoi(optarg);
+			if (halt_every == 0)
+				usage(argv[0]);
+			break;
+		case 'w':
+			halt_wedge = true;
+			break;
+		case 's':
+			if (!strcmp(optarg, "max")) {
+				io_size_max = true;
+				break;
+			}
+			io_size = atoi(optarg);
+			if (io_size == 0 || io_size > EP_IO_SIZE_PROBE_MAX)
+				usage(argv[0]);
+			break;
+		case 'P':
+			io_size_probe_only = true;
+			quiet = true;
+			break;
+		case 'e':
+			enum_cycles = atoi(optarg);
+			if (enum_cycles <= 0)
+				usage(argv[0]);
+			break;
+		case 'I':
+			ioctl_bench_iterations = atoi(optarg);
+			if (ioctl_bench_iterations == 0)
+				usage(argv[0]);
+			quiet = true;
+			break;
+		case 't':
+			ioctl_bench_threads = atoi(optarg);
+			if (ioctl_bench_threads <= 0)
+				usage(argv[0]);
+			break;
+		case 'S':
+			if (!strcmp(optarg, "high"))
+				new_speed = USB_SPEED_HIGH;
+			else if (!strcmp(optarg, "super"))
+				new_speed = USB_SPEED_SUPER;
+			else
+				usage(argv[0]);
+			break;
+		case 'b':
+			bcd = strtoul(optarg, NULL, 0);
+			if (bcd < 0x0200 || bcd > 0xffff)
+				usage(argv[0]);
+			break;
+		case 'm':
+			max_burst = atoi(optarg);
+			if (max_burst < 1 || max_burst > 16)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind < argc)
+		device = argv[optind++];
+	if (optind < argc)
+		driver = argv[optind++];
+	if (optind < argc)
+		usage(argv[0]);
+
+	if (!bcd)
+		bcd = (new_speed == USB_SPEED_SUPER) ? BCD_USB_SS : BCD_USB;
+	if (new_speed == USB_SPEED_SUPER && bcd < 0x0300)
+		usage(argv[0]);
+	set_speed(new_speed, bcd, max_burst);
+
+	bulk_io_size = fast_mode ? io_size : bulk_max_packet;
+	atomic_store(&verbose, verbose_opt == -1 ? !fast_mode : verbose_opt);
+	io_size_max = io_size_max && fast_mode;
+	build_patterns();
+	if (verify_data) {
+		verify_self_check(bulk_max_packet);
+		verify_self_check(EP_MAX_PACKET_INT);
+	}
+	for (int i = 0; i < STATS_NUM; i++)
+		sem_init(&ep_unwedged[i], 0, 0);
+
+	if (enum_cycles) {
+		enum_bench(device, driver, enum_cycles);
+		return 0;
+	}
+
+	if (!quiet)
+		stats_init();
 
 	int fd = usb_raw_open();
-	usb_raw_init(fd, USB_SPEED_HIGH, driver, device);
+	usb_raw_init(fd, speed, driver, device);
 	usb_raw_run(fd);
 
+#ifdef GADGET_EPOLL
+	event_loop(fd);
+#else
 	ep0_loop(fd);
+#endif
 
 	close(fd);
 
@@ -0,0 +1,416 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// A helper program to measure how fast bulk transfers recover from a halt.
+// Streams data to or from a bulk endpoint of gadget.c running with
+// --halt-every (and optionally --wedge), which halts the endpoint
+// mid-stream. On every stall, clears the halt the way a host driver does
+// and measures the time until the transfers run at full speed again.
+// Part of the USB Raw Gadget test suite.
+// See https://github.com/xairy/raw-gadget for details.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <linux/usb/ch9.h>
+#include <linux/usbdevice_fs.h>
+
+#include "latency.h"
+
+// Must match gadget.c.
+#define VENDOR_REQ_UNWEDGE	0x5d
+
+#define INTERFACE	0
+#define TIMEOUT_MS	1000
+
+// Fail if the gadget doesn't halt the endpoint for this long.
+#define NO_STALL_TIMEOUT_NS	(10 * 1000000000ull)
+
+struct transfer {
+	uint64_t	start;
+	uint64_t	end;
+	int		rv;		// Bytes or -errno.
+	uint64_t	cleared;	// When a stall was cleared.
+};
+
+struct result {
+	const char	*direction;
+	unsigned	length;
+	unsigned	stalls;
+	unsigned	unrecovered;
+	double		baseline_us;	// Median transfer duration.
+	double		baseline_mbps;
+	struct latency	stall;		// Failing transfer time.
+	struct latency	clear;		// Clearing the halt.
+	struct latency	first;		// Cleared -> next transfer.
+	struct latency	recover;	// Cleared -> full speed.
+};
+
+static int bulk(int fd, int ep, void *data, unsigned length) {
+	struct usbdevfs_bulktransfer bulk;
+	bulk.ep = ep;
+	bulk.len = length;
+	bulk.timeout = TIMEOUT_MS;
+	bulk.data = data;
+	return ioctl(fd, USBDEVFS_BULK, &bulk);
+}
+
+static int unwedge(int fd, int ep) {
+	struct usbdevfs_ctrltransfer ctrl;
+	ctrl.bRequestType = USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_DIR_OUT;
+	ctrl.bRequest = VENDOR_REQ_UNWEDGE;
+	ctrl.wValue = 0;
+	ctrl.wIndex = ep;
+	ctrl.wLength = 0;
+	ctrl.timeout = TIMEOUT_MS;
+	ctrl.data = NULL;
+	return ioctl(fd, USBDEVFS_CONTROL, &ctrl);
+}
+
+// usbdevfs returns the device descriptor followed by the descriptors of
+// all configurations. Takes the bulk endpoint of the first interface
+// altsetting.
+static int find_endpoint(int fd, bool in, int *addr, int *max_packet) {
+	unsigned char buf[4096];
+	ssize_t length = read(fd, buf, sizeof(buf));
+	bool alt0 = false;
+
+	*addr = 0;
+	for (ssize_t i = USB_DT_DEVICE_SIZE; i + 2 <= length; i += buf[i]) {
+		if (buf[i] == 0)
+			break;
+		if (buf[i + 1] == USB_DT_CONFIG && alt0)
+			break;  // Only the first configuration.
+		if (buf[i + 1] == USB_DT_INTERFACE) {
+			struct usb_interface_descriptor *intf =
+				(struct usb_interface_descriptor *)&buf[i];
+			alt0 = intf->bInterfaceNumber == INTERFACE &&
+					intf->bAlternateSetting == 0;
+			continue;
+		}
+		if (buf[i + 1] != USB_DT_ENDPOINT || !alt0)
+			continue;
+
+		struct usb_endpoint_descriptor *ep =
+				(struct usb_endpoint_descriptor *)&buf[i];
+		if ((ep->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) !=
+				USB_ENDPOINT_XFER_BULK)
+			continue;
+		if (!!(ep->bEndpointAddress & USB_DIR_IN) != in)
+			continue;
+		*addr = ep->bEndpointAddress;
+		*max_packet = __le16_to_cpu(ep->wMaxPacketSize);
+		return 0;
+	}
+
+	return -1;
+}
+
+// Streams until `stalls` stalls were cleared and `window` more transfers
+// were done after the last one. Returns the number of transfers.
+static int stream(int fd, int ep, bool wedge, unsigned char *data,
+			unsigned length, unsigned stalls, unsigned window,
+			struct transfer **transfers) {
+	unsigned num = 0, size = 0, seen = 0, after = 0;
+	uint64_t last_stall = now_ns();
+
+	while (seen < stalls || after < window) {
+		if (num == size) {
+			size = size ? size * 2 : 4096;
+			*transfers = realloc(*transfers,
+						size * sizeof(**transfers));
+			if (!*transfers) {
+				perror("realloc()");
+				exit(EXIT_FAILURE);
+			}
+		}
+		struct transfer *t = &(*transfers)[num++];
+
+		t->start = now_ns();
+		t->rv = bulk(fd, ep, data, length);
+		t->end = now_ns();
+		t->cleared = 0;
+		if (t->rv < 0)
+			t->rv = -errno;
+		if (seen == stalls)
+			after++;
+		if (t->rv >= 0) {
+			if (t->end - last_stall > NO_STALL_TIMEOUT_NS) {
+				fprintf(stderr, "no stalls, is the gadget "
+					"running with --halt-every?\n");
+				return -1;
+			}
+			continue;
+		}
+		if (t->rv != -EPIPE) {
+			errno = -t->rv;
+			perror("ioctl(USBDEVFS_BULK)");
+			return -1;
+		}
+
+		// Both the wedge and the host side state must be cleared.
+		if (wedge && unwedge(fd, ep) < 0) {
+			perror("ioctl(USBDEVFS_CONTROL)");
+			return -1;
+		}
+		unsigned int addr = ep;
+		if (ioctl(fd, USBDEVFS_CLEAR_HALT, &addr) < 0) {
+			perror("ioctl(USBDEVFS_CLEAR_HALT)");
+			return -1;
+		}
+		t->cleared = now_ns();
+		last_stall = t->cleared;
+		if (seen < stalls)
+			seen++;
+	}
+
+	return num;
+}
+
+// A stall is recovered from once `window` transfers in a row take at most
+// `tolerance` percent longer than the median one. Only the first
+// `max_stalls` stalls are accounted, the stream might end right after the
+// following ones.
+static void analyze(struct transfer *transfers, int num, unsigned max_stalls,
+			unsigned window, unsigned tolerance,
+			struct result *res) {
+	uint64_t *samples = calloc(num, sizeof(samples[0]));
+	uint64_t *stall = calloc(num, sizeof(stall[0]));
+	uint64_t *clear = calloc(num, sizeof(clear[0]));
+	uint64_t *first = calloc(num, sizeof(first[0]));
+	uint64_t *recover = calloc(num, sizeof(recover[0]));
+	unsigned n = 0, stalls = 0, firsts = 0, recovered = 0;
+	double limit;
+
+	if (!samples || !stall || !clear || !first || !recover) {
+		perror("calloc()");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < num; i++)
+		if (transfers[i].rv >= 0)
+			samples[n++] = transfers[i].end - transfers[i].start;
+	qsort(samples, n, sizeof(samples[0]), compare_u64);
+	res->baseline_us = n ? samples[n / 2] / 1e3 : 0;
+	res->baseline_mbps = n ? res->length / res->baseline_us : 0;
+	limit = res->baseline_us * 1e3 * (100 + tolerance) / 100;
+
+	for (int i = 0; i < num; i++) {
+		struct transfer *t = &transfers[i];
+		int good = 0;
+
+		if (t->rv >= 0)
+			continue;
+		if (stalls == max_stalls)
+			break;
+		stall[stalls] = t->end - t->start;
+		clear[stalls] = t->cleared - t->end;
+		stalls++;
+		if (i + 1 < num && transfers[i + 1].rv >= 0)
+			first[firsts++] = transfers[i + 1].end - t->cleared;
+
+		for (int j = i + 1; j < num && transfers[j].rv >= 0; j++) {
+			if (transfers[j].end - transfers[j].start > limit) {
+				good = 0;
+				continue;
+			}
+			if (++good < window)
+				continue;
+			// From the clear to the first of the fast ones.
+			recover[recovered++] =
+				transfers[j - window + 1].end - t->cleared;
+			break;
+		}
+	}
+
+	res->stalls = stalls;
+	res->unrecovered = stalls - recovered;
+	summarize(&res->stall, stall, stalls);
+	summarize(&res->clear, clear, stalls);
+	summarize(&res->first, first, firsts);
+	summarize(&res->recover, recover, recovered);
+
+	free(samples);
+	free(stall);
+	free(clear);
+	free(first);
+	free(recover);
+}
+
+static void print_summary(const char *name, const struct latency *sum,
+				bool json) {
+	if (json)
+		printf(", \"%s\": {\"min_us\": %.3f, \"mean_us\": %.3f, "
+			"\"p50_us\": %.3f, \"p99_us\": %.3f, "
+			"\"max_us\": %.3f}", name, sum->min, sum->mean,
+			sum->p50, sum->p99, sum->max);
+	else
+		printf("\t%-8s p50 %.1f us, p99 %.1f us, max %.1f us\n",
+			name, sum->p50, sum->p99, sum->max);
+}
+
+static void print_result(const char *device, const struct result *res,
+				bool json) {
+	if (json) {
+		printf("{\"device\": ");
+		print_json_string(device);
+		printf(", \"direction\": \"%s\", \"length\": %u, "
+			"\"stalls\": %u, \"unrecovered\": %u, "
+			"\"baseline_us\": %.3f, \"baseline_mbps\": %.3f",
+			res->direction, res->length, res->stalls,
+			res->unrecovered, res->baseline_us,
+			res->baseline_mbps);
+	} else
+		printf("%s %s %u bytes: %u stalls, %u not recovered, "
+			"baseline %.1f us/transfer (%.3f MB/s)\n", device,
+			res->direction, res->length, res->stalls,
+			res->unrecovered, res->baseline_us,
+			res->baseline_mbps);
+	print_summary("stall", &res->stall, json);
+	print_summary("clear", &res->clear, json);
+	print_summary("first", &res->first, json);
+	print_summary("recover", &res->recover, json);
+	if (json)
+		printf("}\n");
+}
+
+int main (int argc, char **argv) {
+	unsigned stalls = 100;
+	unsigned length = 4096;
+	unsigned window = 8;
+	unsigned tolerance = 50;
+	bool in = true;
+	bool wedge = false;
+
+	char *device = NULL;
+	bool json = false;
+
+	static const struct option long_options[] = {
+		{"json", no_argument, NULL, 'j'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0},
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "D:c:s:d:k:t:wjh",
+					long_options, NULL)) != EOF) {
+		switch (opt) {
+		case 'D':  // Device path, e.g. /dev/bus/usb/005/003.
+			device = optarg;
+			continue;
+		case 'c':  // Stalls to measure.
+			if (parse_num(optarg, &stalls) || stalls == 0)
+				goto usage;
+			continue;
+		case 's':  // Transfer length.
+			if (parse_num(optarg, &length) || length == 0)
+				goto usage;
+			continue;
+		case 'd':  // Direction.
+			if (strcmp(optarg, "in") && strcmp(optarg, "out"))
+				goto usage;
+			in = !strcmp(optarg, "in");
+			continue;
+		case 'k':  // Fast transfers in a row to count as recovered.
+			if (parse_num(optarg, &window) || window == 0)
+				goto usage;
+			continue;
+		case 't':  // How much slower than the median is fast.
+			if (parse_num(optarg, &tolerance))
+				goto usage;
+			continue;
+		case 'w':  // The gadget wedges the endpoint.
+			wedge = true;
+			continue;
+		case 'j':  // Machine-readable output.
+			json = true;
+			continue;
+		case 'h':
+		default:
+usage:
+			fprintf (stderr,
+				"usage: %s [options]\n"
+				"Options:\n"
+				"\t-D device path\n"
+				"\t-c stalls\t\tdefault 100\n"
+				"\t-s transfer length\tdefault 4096\n"
+				"\t-d in|out\t\tdefault in\n"
+				"\t-k transfers\t\tfast transfers in a row to "
+				"recover, default 8\n"
+				"\t-t percent\t\tslowdown still counted as "
+				"fast, default 50\n"
+				"\t-w\t\t\tthe gadget runs with --wedge\n"
+				"\t-j, --json\t\tprint results as JSON\n",
+				argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc)
+		goto usage;
+	if (!device)
+		goto usage;
+
+	int fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror("open(device)");
+		return EXIT_FAILURE;
+	}
+
+	int ep, max_packet;
+	if (find_endpoint(fd, in, &ep, &max_packet)) {
+		fprintf(stderr, "%s: no bulk %s endpoint\n", device,
+				in ? "in" : "out");
+		return EXIT_FAILURE;
+	}
+
+	// Unbinds usbtest if it's bound.
+	struct usbdevfs_disconnect_claim claim;
+	memset(&claim, 0, sizeof(claim));
+	claim.interface = INTERFACE;
+	if (ioctl(fd, USBDEVFS_DISCONNECT_CLAIM, &claim) < 0) {
+		perror("ioctl(USBDEVFS_DISCONNECT_CLAIM)");
+		return EXIT_FAILURE;
+	}
+
+	// The pattern gadget.c checks OUT data against.
+	unsigned char *data = calloc(1, length);
+	if (!data) {
+		perror("calloc()");
+		return EXIT_FAILURE;
+	}
+	for (unsigned i = 0; i < length; i++)
+		data[i] = (i % max_packet) % 63;
+
+	struct transfer *transfers = NULL;
+	int num = stream(fd, ep, wedge, data, length, stalls, window,
+				&transfers);
+	if (num < 0)
+		return EXIT_FAILURE;
+
+	struct result res;
+	memset(&res, 0, sizeof(res));
+	res.direction = in ? "in" : "out";
+	res.length = length;
+	analyze(transfers, num, stalls, window, tolerance, &res);
+	print_result(device, &res, json);
+
+	free(transfers);
+	free(data);
+	ioctl(fd, USBDEVFS_RELEASEINTERFACE, &claim.interface);
+	close(fd);
+
+	return res.unrecovered ? EXIT_FAILURE : EXIT_SUCCESS;
+}
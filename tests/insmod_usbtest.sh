@@ -2,4 +2,5 @@
 # SPDX-License-Identifier: Apache-2.0
 
 sudo rmmod usbtest 2>/dev/null
-sudo modprobe usbtest pattern=1
+# Set ALT=2 to use the gadget.c altsetting with iso endpoints.
+sudo modprobe usbtest pattern=1 ${ALT:+alt=$ALT}
@@ -0,0 +1,392 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// A helper program to measure interrupt IN latency under bulk load.
+// Polls the interrupt IN endpoint of gadget.c running with --timestamps,
+// first on an idle bus and then while other threads keep the bulk
+// endpoints busy, and reports how old the reports are when they arrive
+// and how regularly they arrive, compared to the endpoint bInterval.
+// The gadget must run on the same machine (i.e. with Dummy UDC), as the
+// report timestamps are compared with the host CLOCK_MONOTONIC.
+// Part of the USB Raw Gadget test suite.
+// See https://github.com/xairy/raw-gadget for details.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <linux/usb/ch9.h>
+#include <linux/usbdevice_fs.h>
+
+#include "latency.h"
+
+#define INTERFACE	0
+#define TIMEOUT_MS	1000
+
+// Reports start with a 64-bit timestamp, see gadget.c --timestamps.
+#define REPORT_SIZE_MAX	64
+
+struct endpoints {
+	int		bulk_in;
+	int		bulk_out;
+	int		bulk_max_packet;
+	int		int_in;
+	int		int_max_packet;
+	uint64_t	int_period_ns;
+};
+
+struct result {
+	const char	*phase;
+	unsigned	reports;
+	unsigned	late;		// Older than one bInterval on arrival.
+	double		bulk_mbps;
+	struct latency	latency;	// Arrival time - gadget timestamp.
+	struct latency	interval;	// Between consecutive arrivals.
+};
+
+struct load {
+	int		fd;
+	int		ep;
+	bool		in;
+	unsigned	length;
+	int		max_packet;
+	volatile bool	*stop;
+	uint64_t	bytes;
+	int		error;
+};
+
+static int transfer(int fd, int ep, void *data, unsigned length) {
+	struct usbdevfs_bulktransfer bulk;
+	bulk.ep = ep;
+	bulk.len = length;
+	bulk.timeout = TIMEOUT_MS;
+	bulk.data = data;
+	// Works for interrupt endpoints too.
+	return ioctl(fd, USBDEVFS_BULK, &bulk);
+}
+
+// usbdevfs returns the device descriptor followed by the descriptors of
+// all configurations. Takes the endpoints of the first interface
+// altsetting, which are always enabled in gadget.c.
+static int find_endpoints(int fd, struct endpoints *eps) {
+	unsigned char buf[4096];
+	ssize_t length = read(fd, buf, sizeof(buf));
+	bool alt0 = false;
+	bool high_speed = ioctl(fd, USBDEVFS_GET_SPEED) >= USB_SPEED_HIGH;
+
+	memset(eps, 0, sizeof(*eps));
+	for (ssize_t i = USB_DT_DEVICE_SIZE; i + 2 <= length; i += buf[i]) {
+		if (buf[i] == 0)
+			break;
+		if (buf[i + 1] == USB_DT_CONFIG && alt0)
+			break;  // Only the first configuration.
+		if (buf[i + 1] == USB_DT_INTERFACE) {
+			struct usb_interface_descriptor *intf =
+				(struct usb_interface_descriptor *)&buf[i];
+			alt0 = intf->bInterfaceNumber == INTERFACE &&
+					intf->bAlternateSetting == 0;
+			continue;
+		}
+		if (buf[i + 1] != USB_DT_ENDPOINT || !alt0)
+			continue;
+
+		struct usb_endpoint_descriptor *ep =
+				(struct usb_endpoint_descriptor *)&buf[i];
+		bool in = ep->bEndpointAddress & USB_DIR_IN;
+		switch (ep->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) {
+		case USB_ENDPOINT_XFER_BULK:
+			eps->bulk_max_packet =
+				__le16_to_cpu(ep->wMaxPacketSize);
+			if (in)
+				eps->bulk_in = ep->bEndpointAddress;
+			else
+				eps->bulk_out = ep->bEndpointAddress;
+			break;
+		case USB_ENDPOINT_XFER_INT:
+			if (!in)
+				break;
+			eps->int_in = ep->bEndpointAddress;
+			eps->int_max_packet =
+				__le16_to_cpu(ep->wMaxPacketSize);
+			// In frames at full speed, 2^(bInterval-1)
+			// microframes at high speed and above.
+			if (high_speed)
+				eps->int_period_ns = 125000ull <<
+						(ep->bInterval - 1);
+			else
+				eps->int_period_ns = 1000000ull *
+						ep->bInterval;
+			break;
+		}
+	}
+
+	if (!eps->bulk_in || !eps->bulk_out || !eps->int_in)
+		return -1;
+	if (eps->int_max_packet < sizeof(uint64_t) ||
+			eps->int_max_packet > REPORT_SIZE_MAX)
+		return -1;
+	return 0;
+}
+
+static void *load_loop(void *arg) {
+	struct load *load = (struct load *)arg;
+	unsigned char *data = calloc(1, load->length);
+
+	// The pattern gadget.c checks OUT data against.
+	for (unsigned i = 0; data && i < load->length; i++)
+		data[i] = (i % load->max_packet) % 63;
+
+	while (data && !*load->stop) {
+		int rv = transfer(load->fd, load->ep, data, load->length);
+		if (rv < 0) {
+			load->error = errno;
+			break;
+		}
+		load->bytes += rv;
+	}
+
+	free(data);
+	return NULL;
+}
+
+static int run(int fd, const struct endpoints *eps, const char *phase,
+		bool load_out, bool load_in, unsigned length,
+		unsigned count, uint64_t *latency, uint64_t *interval,
+		struct result *res) {
+	volatile bool stop = false;
+	struct load loads[2] = {
+		{ fd, eps->bulk_out, false, length, eps->bulk_max_packet,
+		  &stop, 0, 0 },
+		{ fd, eps->bulk_in, true, length, eps->bulk_max_packet,
+		  &stop, 0, 0 },
+	};
+	pthread_t threads[2];
+	bool started[2] = { load_out, load_in };
+	unsigned char report[REPORT_SIZE_MAX];
+	uint64_t prev = 0, start, end;
+	int status = 0;
+
+	memset(res, 0, sizeof(*res));
+	res->phase = phase;
+
+	for (int i = 0; i < 2; i++)
+		if (started[i])
+			pthread_create(&threads[i], 0, load_loop, &loads[i]);
+
+	// Drop the report that was queued before the test started.
+	if (transfer(fd, eps->int_in, report, eps->int_max_packet) < 0)
+		status = -1;
+
+	start = now_ns();
+	for (unsigned i = 0; i < count && !status; i++) {
+		uint64_t ts;
+
+		int rv = transfer(fd, eps->int_in, report, eps->int_max_packet);
+		uint64_t arrival = now_ns();
+		if (rv < (int)sizeof(ts)) {
+			status = -1;
+			break;
+		}
+		memcpy(&ts, report, sizeof(ts));
+		latency[i] = arrival > ts ? arrival - ts : 0;
+		if (latency[i] > eps->int_period_ns)
+			res->late++;
+		if (i)
+			interval[i - 1] = arrival - prev;
+		prev = arrival;
+		res->reports++;
+	}
+	end = now_ns();
+
+	stop = true;
+	for (int i = 0; i < 2; i++) {
+		if (!started[i])
+			continue;
+		pthread_join(threads[i], NULL);
+		res->bulk_mbps += loads[i].bytes / ((end - start) / 1e3);
+		if (loads[i].error) {
+			errno = loads[i].error;
+			perror(loads[i].in ? "bulk in" : "bulk out");
+			status = -1;
+		}
+	}
+
+	summarize(&res->latency, latency, res->reports);
+	summarize(&res->interval, interval,
+			res->reports ? res->reports - 1 : 0);
+	return status;
+}
+
+static void print_result(const char *device, const struct endpoints *eps,
+				const struct result *res, bool json,
+				bool histogram) {
+	double period = eps->int_period_ns / 1e3;
+
+	if (json) {
+		printf("{\"device\": ");
+		print_json_string(device);
+		printf(", \"phase\": \"%s\", \"reports\": %u, "
+			"\"late\": %u, \"binterval_us\": %.3f, "
+			"\"bulk_mbps\": %.3f, ", res->phase, res->reports,
+			res->late, period, res->bulk_mbps);
+		printf("\"latency\": {");
+		print_latency_json(&res->latency);
+		printf("}, \"interval\": {");
+		print_latency_json(&res->interval);
+		printf("}}\n");
+		return;
+	}
+
+	printf("%s %s: %u reports, bulk %.3f MB/s, bInterval %.1f us\n",
+		device, res->phase, res->reports, res->bulk_mbps, period);
+	printf("\tlatency:  p50 %.1f us, p99 %.1f us, p99.9 %.1f us, "
+		"max %.1f us, %u late (%.2f%%)\n", res->latency.p50,
+		res->latency.p99, res->latency.p999, res->latency.max,
+		res->late, res->reports ? 100.0 * res->late / res->reports : 0);
+	if (histogram)
+		print_histogram(&res->latency);
+	printf("\tinterval: p50 %.1f us, p99 %.1f us, p99.9 %.1f us, "
+		"max %.1f us\n", res->interval.p50, res->interval.p99,
+		res->interval.p999, res->interval.max);
+	if (histogram)
+		print_histogram(&res->interval);
+}
+
+int main (int argc, char **argv) {
+	unsigned count = 5000;
+	unsigned length = 65536;
+	unsigned max_late = 100;
+	bool load_out = true, load_in = true;
+
+	char *device = NULL;
+	bool json = false;
+	bool histogram = false;
+
+	static const struct option long_options[] = {
+		{"json", no_argument, NULL, 'j'},
+		{"histogram", no_argument, NULL, 'H'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0},
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "D:c:s:l:m:jHh",
+					long_options, NULL)) != EOF) {
+		switch (opt) {
+		case 'D':  // Device path, e.g. /dev/bus/usb/005/003.
+			device = optarg;
+			continue;
+		case 'c':  // Reports per phase.
+			if (parse_num(optarg, &count) || count < 2)
+				goto usage;
+			continue;
+		case 's':  // Bulk transfer length.
+			if (parse_num(optarg, &length) || length == 0)
+				goto usage;
+			continue;
+		case 'l':  // Bulk load direction.
+			load_out = !strcmp(optarg, "out") ||
+					!strcmp(optarg, "both");
+			load_in = !strcmp(optarg, "in") ||
+					!strcmp(optarg, "both");
+			if (!load_out && !load_in)
+				goto usage;
+			continue;
+		case 'm':  // Allowed late reports under load, percent.
+			if (parse_num(optarg, &max_late) || max_late > 100)
+				goto usage;
+			continue;
+		case 'j':  // Machine-readable output.
+			json = true;
+			continue;
+		case 'H':  // Print latency histograms.
+			histogram = true;
+			continue;
+		case 'h':
+		default:
+usage:
+			fprintf (stderr,
+				"usage: %s [options]\n"
+				"Options:\n"
+				"\t-D device path\n"
+				"\t-c reports per phase\tdefault 5000\n"
+				"\t-s bulk length\t\tdefault 65536\n"
+				"\t-l out|in|both\t\tbulk load, default both\n"
+				"\t-m percent\t\tfail if more reports are late "
+				"under load, default 100\n"
+				"\t-j, --json\t\tprint results as JSON\n"
+				"\t-H, --histogram\t\tprint latency histograms\n",
+				argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc)
+		goto usage;
+	if (!device)
+		goto usage;
+
+	int fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror("open(device)");
+		return EXIT_FAILURE;
+	}
+
+	struct endpoints eps;
+	if (find_endpoints(fd, &eps)) {
+		fprintf(stderr, "%s: no bulk and interrupt IN endpoints\n",
+				device);
+		return EXIT_FAILURE;
+	}
+
+	// Unbinds usbtest if it's bound.
+	struct usbdevfs_disconnect_claim claim;
+	memset(&claim, 0, sizeof(claim));
+	claim.interface = INTERFACE;
+	if (ioctl(fd, USBDEVFS_DISCONNECT_CLAIM, &claim) < 0) {
+		perror("ioctl(USBDEVFS_DISCONNECT_CLAIM)");
+		return EXIT_FAILURE;
+	}
+
+	uint64_t *latency = calloc(count, sizeof(latency[0]));
+	uint64_t *interval = calloc(count, sizeof(interval[0]));
+	if (!latency || !interval) {
+		perror("calloc()");
+		return EXIT_FAILURE;
+	}
+
+	struct result idle, loaded;
+	if (run(fd, &eps, "idle", false, false, length, count,
+				latency, interval, &idle)) {
+		perror("interrupt in");
+		return EXIT_FAILURE;
+	}
+	print_result(device, &eps, &idle, json, histogram);
+	if (run(fd, &eps, "load", load_out, load_in, length, count,
+				latency, interval, &loaded)) {
+		perror("interrupt in");
+		return EXIT_FAILURE;
+	}
+	print_result(device, &eps, &loaded, json, histogram);
+
+	free(latency);
+	free(interval);
+	ioctl(fd, USBDEVFS_RELEASEINTERFACE, &claim.interface);
+	close(fd);
+
+	if (loaded.late * 100ull > (uint64_t)max_late * loaded.reports)
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,148 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Latency statistics and output helpers shared by the host-side programs.
+// Part of the USB Raw Gadget test suite.
+// See https://github.com/xairy/raw-gadget for details.
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Histogram buckets are powers of two in microseconds: [0, 1), [1, 2),
+// [2, 4), ..., the last one collects everything above.
+#define HIST_BUCKETS	24
+
+struct latency {
+	double		min, mean, p50, p99, p999, max;
+	unsigned	hist[HIST_BUCKETS];
+};
+
+static inline uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples, in microseconds. The rank
+// is ceil(per_mille * n / 1000), computed in integers so that exact
+// ranks (e.g. p99 of 100 samples) don't get rounded up by float error.
+static inline double percentile(const uint64_t *samples, unsigned n,
+					unsigned per_mille) {
+	uint64_t rank = ((uint64_t)per_mille * n + 999) / 1000;
+	if (rank < 1)
+		rank = 1;
+	if (rank > n)
+		rank = n;
+	return samples[rank - 1] / 1e3;
+}
+
+// Sorts the samples (in nanoseconds) and fills in the summary.
+static inline void summarize(struct latency *lat, uint64_t *samples,
+				unsigned n) {
+	double total = 0;
+
+	memset(lat, 0, sizeof(*lat));
+	if (!n)
+		return;
+	qsort(samples, n, sizeof(samples[0]), compare_u64);
+	for (unsigned i = 0; i < n; i++) {
+		uint64_t us = samples[i] / 1000;
+		int bucket = 0;
+		while (us && bucket < HIST_BUCKETS - 1) {
+			us >>= 1;
+			bucket++;
+		}
+		lat->hist[bucket]++;
+		total += samples[i];
+	}
+
+	lat->min = samples[0] / 1e3;
+	lat->max = samples[n - 1] / 1e3;
+	lat->mean = total / n / 1e3;
+	lat->p50 = percentile(samples, n, 500);
+	lat->p99 = percentile(samples, n, 990);
+	lat->p999 = percentile(samples, n, 999);
+}
+
+// Prints the summary as JSON object members, without the braces.
+static inline void print_latency_json(const struct latency *lat) {
+	printf("\"min_us\": %.3f, \"mean_us\": %.3f, \"p50_us\": %.3f, "
+		"\"p99_us\": %.3f, \"p999_us\": %.3f, \"max_us\": %.3f, "
+		"\"histogram\": [", lat->min, lat->mean, lat->p50, lat->p99,
+		lat->p999, lat->max);
+	bool first = true;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		if (!lat->hist[i])
+			continue;
+		if (i == HIST_BUCKETS - 1)
+			printf("%s{\"lt_us\": null, \"count\": %u}",
+				first ? "" : ", ", lat->hist[i]);
+		else
+			printf("%s{\"lt_us\": %lu, \"count\": %u}",
+				first ? "" : ", ", 1ul << i, lat->hist[i]);
+		first = false;
+	}
+	printf("]");
+}
+
+static inline void print_histogram(const struct latency *lat) {
+	unsigned peak = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++)
+		if (lat->hist[i] > peak)
+			peak = lat->hist[i];
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		if (!lat->hist[i])
+			continue;
+		if (i == HIST_BUCKETS - 1)
+			printf("\t[%7lu,     inf) us: %8u ", 1ul << (i - 1),
+				lat->hist[i]);
+		else
+			printf("\t[%7lu, %7lu) us: %8u ",
+				i ? 1ul << (i - 1) : 0, 1ul << i,
+				lat->hist[i]);
+		for (unsigned j = 0; j < lat->hist[i] * 40 / peak; j++)
+			printf("#");
+		printf("\n");
+	}
+}
+
+// Prints a JSON string literal, e.g. a device path.
+static inline void print_json_string(const char *str) {
+	putchar('"');
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			printf("\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			printf("\\u%04x", *str);
+		else
+			putchar(*str);
+	}
+	putchar('"');
+}
+
+static inline int parse_num(const char *str, unsigned int *num) {
+	unsigned long val;
+	char *end;
+
+	errno = 0;
+	val = strtoul(str, &end, 0);
+	if (errno || *end || val > UINT_MAX)
+		return -1;
+	*num = val;
+	return 0;
+}
+
+#endif // LATENCY_H
@@ -0,0 +1,165 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: Apache-2.0
+
+# Sweeps the size of the transfers the test gadget submits to Raw Gadget,
+# up to the largest one Raw Gadget accepts, and records bulk throughput
+# for each size.
+
+import argparse
+import datetime
+import json
+import platform
+import subprocess
+import sys
+
+from run_scaling import find_devices, wait_devices, stop_gadgets
+from run_tests import int_list, run_test_json, summarize
+
+# Bulk OUT and IN, non-queued and queued.
+sweep_tests = [
+	("test 1: bulk, non-queued, OUT", 1),
+	("test 2: bulk, non-queued, IN", 2),
+	("test 5: bulk, queued, OUT", 5),
+	("test 6: bulk, queued, IN", 6),
+]
+
+def probe_max_size(args):
+	out = subprocess.check_output(["./gadget"] + args.gadget_args.split() +
+			["--probe-io-size", args.device, args.driver],
+			universal_newlines=True)
+	return int(out.strip().splitlines()[-1])
+
+def default_sizes(max_size):
+	sizes = []
+	size = 512
+	while size < max_size:
+		sizes.append(size)
+		size *= 2
+	sizes.append(max_size)
+	return sizes
+
+def run_size(size, args):
+	cmd = ["./gadget", "--fast", "--io-size", str(size)] + \
+		args.gadget_args.split() + [args.device, args.driver]
+	gadget = subprocess.Popen(cmd, stdout=subprocess.DEVNULL)
+	try:
+		devices = wait_devices(1, args.timeout)
+		if devices is None:
+			print("FAILURE: the device didn't show up")
+			return None
+		results = []
+		for test in sweep_tests:
+			mbps = []
+			failures = 0
+			for i in range(args.repeat):
+				r = run_test_json(devices[0], test[1],
+						args.count, args.length,
+						args.length, args.sglen)
+				if r.get("status") != "success":
+					failures += 1
+					continue
+				mbps.append(r["mbps"])
+			result = {
+				"test": test[0],
+				"num": test[1],
+				"failures": failures,
+				"mbps": summarize(mbps),
+			}
+			if result["mbps"]:
+				print("%s: %.3f MB/s" % (test[0],
+					result["mbps"]["median"]))
+			else:
+				print("%s: FAILURE" % (test[0],))
+			results.append(result)
+	finally:
+		stop_gadgets([gadget])
+		wait_devices(0, args.timeout)
+	return results
+
+def plot(points, filename):
+	import matplotlib
+	matplotlib.use("Agg")
+	import matplotlib.pyplot as plt
+
+	fig, ax = plt.subplots()
+	ax.set_xscale("log", base=2)
+	ax.set_xlabel("gadget transfer size, bytes")
+	ax.set_ylabel("MB/s (median)")
+	for (i, test) in enumerate(sweep_tests):
+		sizes = [p["size"] for p in points if p["results"][i]["mbps"]]
+		mbps = [p["results"][i]["mbps"]["median"]
+				for p in points if p["results"][i]["mbps"]]
+		ax.plot(sizes, mbps, "o-", label=test[0])
+	ax.legend()
+	fig.tight_layout()
+	fig.savefig(filename)
+
+if __name__ == '__main__':
+	parser = argparse.ArgumentParser()
+	parser.add_argument("file", metavar="FILE", help="results log")
+	parser.add_argument("--device", default="dummy_udc.0",
+			help="UDC device")
+	parser.add_argument("--driver", default="dummy_udc",
+			help="UDC driver")
+	parser.add_argument("--gadget-args", default="",
+			help="extra arguments for ./gadget, e.g. --speed super")
+	parser.add_argument("--sizes", type=int_list,
+			help="comma-separated transfer sizes, by default "
+				"powers of two from 512 up to the largest "
+				"accepted size")
+	parser.add_argument("--count", type=int, default=1000)
+	parser.add_argument("--length", type=int, default=65536,
+			help="host side transfer length")
+	parser.add_argument("--sglen", type=int, default=32)
+	parser.add_argument("--repeat", type=int, default=3,
+			help="runs per test and size")
+	parser.add_argument("--timeout", type=float, default=10,
+			help="seconds to wait for the device to (dis)appear")
+	parser.add_argument("--plot", metavar="PNG",
+			help="plot the results, requires matplotlib")
+	args = parser.parse_args()
+
+	if find_devices():
+		print("FAILURE: a test gadget is already connected")
+		sys.exit(1)
+
+	max_size = probe_max_size(args)
+	print("largest accepted transfer size: %d" % (max_size,))
+	wait_devices(0, args.timeout)
+	sizes = args.sizes or default_sizes(max_size)
+
+	points = []
+	for size in sizes:
+		if size > max_size:
+			print("size %d: skipped, above the limit" % (size,))
+			continue
+		print("size %d:" % (size,))
+		r = run_size(size, args)
+		if r is None:
+			continue
+		points.append({"size": size, "results": r})
+
+	metadata = {
+		"device": args.device,
+		"driver": args.driver,
+		"gadget_args": args.gadget_args,
+		"max_size": max_size,
+		"count": args.count,
+		"length": args.length,
+		"sglen": args.sglen,
+		"repeat": args.repeat,
+		"kernel": platform.release(),
+		"machine": platform.machine(),
+		"date": datetime.datetime.now().isoformat(),
+	}
+	s = json.dumps({"metadata": metadata, "points": points},
+			indent=4, sort_keys=True)
+	with open(args.file, 'w+') as f:
+		f.write(s)
+		f.write("\n")
+
+	if args.plot:
+		plot(points, args.plot)
+
+	failed = [p for p in points if any(r["failures"] for r in p["results"])]
+	sys.exit(1 if failed or len(points) != len(sizes) else 0)
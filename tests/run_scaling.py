@@ -0,0 +1,214 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: Apache-2.0
+
+# Runs one test gadget per Dummy UDC instance and usbtest on all of them
+# concurrently, for an increasing number of instances.
+
+import argparse
+import datetime
+import json
+import os
+import platform
+import subprocess
+import sys
+import time
+
+from run_tests import int_list, summarize
+
+SYSFS_USB_DEVICES = "/sys/bus/usb/devices"
+
+# Must match gadget.c.
+USB_VENDOR = 0x0525
+USB_PRODUCT = 0xa4a0
+
+def sysfs_read(dev, attr):
+	try:
+		with open(os.path.join(SYSFS_USB_DEVICES, dev, attr)) as f:
+			return f.read().strip()
+	except OSError:
+		return None
+
+def find_devices():
+	devices = []
+	for dev in sorted(os.listdir(SYSFS_USB_DEVICES)):
+		if ":" in dev:
+			continue
+		vendor = sysfs_read(dev, "idVendor")
+		product = sysfs_read(dev, "idProduct")
+		if vendor is None or product is None:
+			continue
+		if (int(vendor, 16), int(product, 16)) != \
+				(USB_VENDOR, USB_PRODUCT):
+			continue
+		if not sysfs_read(dev, "bConfigurationValue"):
+			continue
+		busnum = int(sysfs_read(dev, "busnum"))
+		devnum = int(sysfs_read(dev, "devnum"))
+		devices.append("/dev/bus/usb/%03d/%03d" % (busnum, devnum))
+	return devices
+
+def wait_devices(num, timeout):
+	deadline = time.monotonic() + timeout
+	while True:
+		devices = find_devices()
+		if len(devices) == num:
+			return devices
+		if time.monotonic() > deadline:
+			return None
+		time.sleep(0.05)
+
+def start_gadgets(num, args):
+	gadgets = []
+	for i in range(num):
+		cmd = ["./gadget"] + args.gadget_args.split() + \
+			["%s.%d" % (args.driver, i), args.driver]
+		gadgets.append(subprocess.Popen(cmd,
+				stdout=subprocess.DEVNULL))
+	return gadgets
+
+def stop_gadgets(gadgets):
+	for g in gadgets:
+		g.terminate()
+	for g in gadgets:
+		g.wait()
+
+def run_concurrently(devices, args):
+	cmd = lambda device: ("./testusb", "--json",
+		"-D", device,
+		"-t", str(args.test),
+		"-c", str(args.count),
+		"-s", str(args.length),
+		"-v", str(args.length),
+		"-g", str(args.sglen),
+	)
+	start = time.monotonic()
+	procs = [subprocess.Popen(cmd(d), stdout=subprocess.PIPE,
+				universal_newlines=True) for d in devices]
+	outputs = [p.communicate()[0] for p in procs]
+	wall = time.monotonic() - start
+	results = []
+	for (p, out) in zip(procs, outputs):
+		try:
+			results.append(json.loads(out))
+		except ValueError:
+			results.append({"status": "failure",
+					"errno": p.returncode})
+	return wall, results
+
+def run_point(num, args):
+	if find_devices():
+		print("FAILURE: test gadgets are already connected")
+		sys.exit(1)
+	gadgets = start_gadgets(num, args)
+	try:
+		devices = wait_devices(num, args.timeout)
+		if devices is None:
+			print("FAILURE: %d devices didn't show up" % (num,))
+			return None
+		aggregate = []
+		latencies = []
+		failures = 0
+		for i in range(args.repeat):
+			wall, results = run_concurrently(devices, args)
+			total = 0
+			for r in results:
+				if r.get("status") != "success":
+					failures += 1
+					continue
+				total += r.get("bytes", 0) / 1e6
+				latencies.append(r["latency_us"])
+			aggregate.append(total / wall)
+	finally:
+		stop_gadgets(gadgets)
+		wait_devices(0, args.timeout)
+	return {
+		"instances": num,
+		"devices": devices,
+		"failures": failures,
+		"aggregate_mbps": summarize(aggregate),
+		"latency_us": summarize(latencies),
+	}
+
+def plot(results, filename):
+	import matplotlib
+	matplotlib.use("Agg")
+	import matplotlib.pyplot as plt
+
+	points = [r for r in results if r["latency_us"]]
+	n = [r["instances"] for r in points]
+	fig, ax1 = plt.subplots()
+	ax1.set_xlabel("instances")
+	ax1.set_ylabel("aggregate MB/s")
+	ax1.plot(n, [r["aggregate_mbps"]["median"] for r in points], "o-",
+			color="tab:blue")
+	ax2 = ax1.twinx()
+	ax2.set_ylabel("per-device us/iteration (median, p95)")
+	ax2.plot(n, [r["latency_us"]["median"] for r in points], "s--",
+			color="tab:red")
+	ax2.plot(n, [r["latency_us"]["p95"] for r in points], "s:",
+			color="tab:red")
+	fig.tight_layout()
+	fig.savefig(filename)
+
+if __name__ == '__main__':
+	parser = argparse.ArgumentParser()
+	parser.add_argument("file", metavar="FILE", help="results log")
+	parser.add_argument("--instances", type=int_list,
+			default=[1, 2, 4, 8],
+			help="comma-separated numbers of gadgets, dummy_hcd "
+				"must be loaded with num= at least the largest")
+	parser.add_argument("--driver", default="dummy_udc",
+			help="UDC driver, devices are DRIVER.0, DRIVER.1, ...")
+	parser.add_argument("--gadget-args", default="--fast",
+			help="extra arguments for ./gadget")
+	parser.add_argument("--test", type=int, default=1,
+			help="usbtest test number")
+	parser.add_argument("--count", type=int, default=1000)
+	parser.add_argument("--length", type=int, default=4096)
+	parser.add_argument("--sglen", type=int, default=32)
+	parser.add_argument("--repeat", type=int, default=3,
+			help="runs per number of instances")
+	parser.add_argument("--timeout", type=float, default=10,
+			help="seconds to wait for devices to (dis)appear")
+	parser.add_argument("--plot", metavar="PNG",
+			help="plot the results, requires matplotlib")
+	args = parser.parse_args()
+
+	results = []
+	for num in args.instances:
+		print("%d instances: test %d, count %d, length %d" %
+			(num, args.test, args.count, args.length))
+		r = run_point(num, args)
+		if r is None:
+			continue
+		if r["latency_us"]:
+			print("aggregate %.3f MB/s, latency median %.3f us, "
+				"p95 %.3f us, %d failures" %
+				(r["aggregate_mbps"]["median"],
+				r["latency_us"]["median"],
+				r["latency_us"]["p95"], r["failures"]))
+		else:
+			print("FAILURE: all runs failed")
+		results.append(r)
+
+	metadata = {
+		"driver": args.driver,
+		"gadget_args": args.gadget_args,
+		"test": args.test,
+		"count": args.count,
+		"length": args.length,
+		"sglen": args.sglen,
+		"repeat": args.repeat,
+		"kernel": platform.release(),
+		"machine": platform.machine(),
+		"cpus": os.cpu_count(),
+		"date": datetime.datetime.now().isoformat(),
+	}
+	s = json.dumps({"metadata": metadata, "results": results},
+			indent=4, sort_keys=True)
+	with open(args.file, 'w+') as f:
+		f.write(s)
+		f.write("\n")
+
+	if args.plot:
+		plot(results, args.plot)
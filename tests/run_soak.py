@@ -0,0 +1,197 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: Apache-2.0
+
+# Runs mixed bulk, interrupt and control traffic for a long time and checks
+# that throughput stays stable and that kernel memory doesn't grow.
+
+import argparse
+import datetime
+import json
+import platform
+import statistics
+import subprocess
+import sys
+import time
+
+from run_tests import run_test_json
+
+# Traffic run in every round: (name, test, count, length).
+soak_tests = [
+	("bulk OUT", 1, 1000, 4096),
+	("bulk IN", 2, 1000, 4096),
+	("bulk queued OUT", 5, 100, 4096),
+	("bulk queued IN", 6, 100, 4096),
+	("control queued", 10, 100, 1024),
+	("interrupt OUT", 25, 1000, 64),
+	("interrupt IN", 26, 1000, 64),
+]
+
+def read_meminfo():
+	info = {}
+	with open("/proc/meminfo") as f:
+		for line in f:
+			(key, value) = line.split(":", 1)
+			info[key] = int(value.split()[0])
+	return info
+
+def read_kmalloc_slabs():
+	# Raw Gadget events and transfer buffers and dummy_hcd URB entries
+	# are plain kmalloc() allocations. /proc/slabinfo needs root.
+	slabs = {}
+	try:
+		with open("/proc/slabinfo") as f:
+			for line in f:
+				fields = line.split()
+				if not fields[0].startswith("kmalloc-"):
+					continue
+				# name active_objs num_objs objsize ...
+				slabs[fields[0]] = int(fields[1]) * int(fields[3])
+	except OSError:
+		return None
+	return slabs
+
+def run_ctrlbench(device):
+	args = ("./ctrlbench", "--json", "-D", device, "-c", "1000",
+			"-s", "64")
+	r = subprocess.run(args, stdout=subprocess.PIPE,
+				universal_newlines=True)
+	results = []
+	for line in r.stdout.splitlines():
+		try:
+			results.append(json.loads(line))
+		except ValueError:
+			pass
+	return r.returncode, results
+
+def run_round(device):
+	sample = {"time": time.time(), "tests": {}, "failures": 0}
+	for (name, test, count, length) in soak_tests:
+		r = run_test_json(device, test, count, length, length, 32)
+		if r.get("status") != "success":
+			sample["failures"] += 1
+			continue
+		# Throughput in MB/s, or in transfers per second for tests
+		# without a known size.
+		sample["tests"][name] = {
+			"throughput": r.get("mbps", r["transfers_per_sec"]),
+			"unit": "MB/s" if "mbps" in r else "transfers/s",
+			"latency_us": r["latency_us"],
+		}
+	code, ctrl = run_ctrlbench(device)
+	if code != 0:
+		sample["failures"] += 1
+	for c in ctrl:
+		sample["tests"]["ep0 %s" % (c["direction"],)] = {
+			"p50_us": c["p50_us"],
+			"p99_us": c["p99_us"],
+		}
+	meminfo = read_meminfo()
+	sample["slab_unreclaimable_kb"] = meminfo.get("SUnreclaim", 0)
+	slabs = read_kmalloc_slabs()
+	if slabs is not None:
+		sample["kmalloc_kb"] = sum(slabs.values()) / 1024
+	return sample
+
+def check(samples, args):
+	# The first rounds are the baseline, and the last ones are compared
+	# against it, so that single noisy rounds don't matter.
+	window = min(args.window, len(samples) // 2)
+	if window == 0:
+		return []
+	base = samples[:window]
+	last = samples[-window:]
+	problems = []
+
+	for name in base[0]["tests"]:
+		if "throughput" not in base[0]["tests"][name]:
+			continue
+		before = statistics.median(s["tests"][name]["throughput"]
+				for s in base if name in s["tests"])
+		after = [s["tests"][name]["throughput"]
+				for s in last if name in s["tests"]]
+		if not after:
+			problems.append("%s: no successful runs" % (name,))
+			continue
+		after = statistics.median(after)
+		if after < before * (1 - args.drift / 100.0):
+			problems.append("%s: throughput dropped from %.3f "
+					"to %.3f %s" % (name, before, after,
+					base[0]["tests"][name]["unit"]))
+
+	for key in ("slab_unreclaimable_kb", "kmalloc_kb"):
+		if key not in base[0]:
+			continue
+		before = min(s[key] for s in base)
+		after = min(s[key] for s in last)
+		if after - before > args.leak_kb:
+			problems.append("%s: grew from %d to %d KiB" %
+					(key, before, after))
+
+	failures = sum(s["failures"] for s in samples)
+	if failures:
+		problems.append("%d failed runs" % (failures,))
+	return problems
+
+def print_sample(i, sample):
+	tests = sample["tests"]
+	line = []
+	for (name, r) in tests.items():
+		if "throughput" in r:
+			line.append("%s %.3f %s" %
+					(name, r["throughput"], r["unit"]))
+		else:
+			line.append("%s p50 %.1f us p99 %.1f us" %
+					(name, r["p50_us"], r["p99_us"]))
+	line.append("SUnreclaim %d KiB" % (sample["slab_unreclaimable_kb"],))
+	if "kmalloc_kb" in sample:
+		line.append("kmalloc %d KiB" % (sample["kmalloc_kb"],))
+	print("round %d: %s" % (i, ", ".join(line)))
+
+if __name__ == '__main__':
+	parser = argparse.ArgumentParser()
+	parser.add_argument("device", metavar="DEVICE",
+			help="e.g. /dev/bus/usb/005/002")
+	parser.add_argument("file", metavar="FILE", help="results log")
+	parser.add_argument("--duration", type=float, default=3600,
+			help="seconds to run for")
+	parser.add_argument("--interval", type=float, default=60,
+			help="seconds between rounds of traffic")
+	parser.add_argument("--window", type=int, default=3,
+			help="rounds averaged at the start and at the end")
+	parser.add_argument("--drift", type=float, default=10,
+			help="allowed throughput drop, percent")
+	parser.add_argument("--leak-kb", type=int, default=1024,
+			help="allowed kernel memory growth, KiB")
+	args = parser.parse_args()
+
+	samples = []
+	start = time.monotonic()
+	while time.monotonic() - start < args.duration:
+		round_start = time.monotonic()
+		sample = run_round(args.device)
+		print_sample(len(samples), sample)
+		samples.append(sample)
+		elapsed = time.monotonic() - round_start
+		if elapsed < args.interval:
+			time.sleep(args.interval - elapsed)
+
+	problems = check(samples, args)
+	metadata = {
+		"device": args.device,
+		"duration": args.duration,
+		"interval": args.interval,
+		"kernel": platform.release(),
+		"machine": platform.machine(),
+		"date": datetime.datetime.now().isoformat(),
+	}
+	s = json.dumps({"metadata": metadata, "samples": samples,
+			"problems": problems}, indent=4, sort_keys=True)
+	with open(args.file, 'w+') as f:
+		f.write(s)
+		f.write("\n")
+
+	for p in problems:
+		print("FAILURE: %s" % (p,))
+	if not problems:
+		print("SUCCESS")
+	sys.exit(1 if problems else 0)
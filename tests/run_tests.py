@@ -1,11 +1,20 @@
 #!/usr/bin/env python3
 # SPDX-License-Identifier: Apache-2.0
 
+import argparse
+import datetime
 import errno
 import json
+import math
 import os
+import platform
+import re
+import resource
+import shutil
+import statistics
 import subprocess
 import sys
+import tempfile
 
 tests = [
 	("test 1: bulk, non-queued, OUT", 1, {}),
@@ -22,23 +31,41 @@ tests = [
 	("test 12: bulk, non-queued, unlinks, OUT", 12, {}),
 	("test 13: bulk, ep halt set/clear", 13, {}),
 	("test 14: control, OUT, varied", 14, {"length": 256, "vary": 8}),
-	# Tests 15 and 16 require ISO transfers support.
+	# Tests 15, 16, 22 and 23 need usbtest loaded with alt=2 (see
+	# insmod_usbtest.sh) and a UDC with iso support, otherwise usbtest
+	# skips them.
+	("test 15: iso, queued, OUT", 15, {}),
+	("test 16: iso, queued, IN", 16, {}),
 	("test 17: bulk, DMA, odd address, OUT", 17, {}),
 	("test 18: bulk, DMA, odd address, IN", 18, {}),
 	("test 19: bulk, coherent, odd address, OUT", 19, {}),
 	("test 20: bulk, coherent, odd address, IN", 20, {}),
 	("test 21: control, unaligned, OUT, varied", 21, {"length": 128, "vary": 8}),
-	# Tests 22 and 23 require ISO transfers support.
+	("test 22: iso, queued, unaligned, OUT", 22, {}),
+	("test 23: iso, queued, unaligned, IN", 23, {}),
 	("test 24: bulk, queued, unlink, OUT", 24, {}),
 	("test 25: interrupt, non-queued, OUT", 25, {"length": 64}),
 	("test 26: interrupt, non-queued, IN", 26, {"length": 64}),
 ]
 
-def run_test(device, test, count, **kwargs):
+# Tests swept in benchmark mode and the parameters swept for each.
+bench_tests = [
+	("test 1: bulk, non-queued, OUT", 1, ("length",)),
+	("test 2: bulk, non-queued, IN", 2, ("length",)),
+	("test 5: bulk, queued, OUT", 5, ("length", "sglen")),
+	("test 6: bulk, queued, IN", 6, ("length", "sglen")),
+	("test 10: control, queued", 10, ()),
+]
+
+bench_lengths = [64, 512, 1024, 4096, 16384, 65536, 131072]
+bench_sglens = [1, 8, 32]
+bench_counts = [8, 64, 512]
+
+def run_test(device, test, count, prefix=(), **kwargs):
 	length = kwargs.get("length", 1024)
 	vary = kwargs.get("vary", 1024)
 	sglen = kwargs.get("sglen", 32)
-	args = ("./testusb",
+	args = prefix + ("./testusb",
 		"-D", str(device),
 		"-t", str(test),
 		"-c", str(count),
@@ -50,31 +77,448 @@ def run_test(device, test, count, **kwargs):
 	r = subprocess.run(args)
 	return r.returncode
 
-def run_tests(device, count):
+def run_test_json(device, test, count, length, vary, sglen, prefix=()):
+	args = prefix + ("./testusb", "--json",
+		"-D", str(device),
+		"-t", str(test),
+		"-c", str(count),
+		"-s", str(length),
+		"-v", str(vary),
+		"-g", str(sglen),
+	)
+	r = subprocess.run(args, stdout=subprocess.PIPE,
+				universal_newlines=True)
+	try:
+		return json.loads(r.stdout)
+	except ValueError:
+		return {"status": "failure", "errno": r.returncode}
+
+def proc_cpu_us(pid):
+	# utime + stime of all threads of the process.
+	with open("/proc/%d/stat" % (pid,)) as f:
+		fields = f.read().rsplit(")", 1)[1].split()
+	ticks = int(fields[11]) + int(fields[12])
+	return ticks * 1e6 / os.sysconf("SC_CLK_TCK")
+
+def system_cpu_us():
+	# Busy time of all CPUs: everything but idle and iowait.
+	with open("/proc/stat") as f:
+		fields = [int(x) for x in f.readline().split()[1:]]
+	busy = sum(fields[:8]) - fields[3] - fields[4]
+	return busy * 1e6 / os.sysconf("SC_CLK_TCK")
+
+def children_cpu_us():
+	r = resource.getrusage(resource.RUSAGE_CHILDREN)
+	return (r.ru_utime + r.ru_stime) * 1e6
+
+def read_perf_cycles(filename):
+	# perf stat -x, lines: value,unit,event,...
+	with open(filename) as f:
+		for line in f:
+			fields = line.strip().split(",")
+			if len(fields) > 2 and fields[2].startswith("cycles"):
+				try:
+					return int(fields[0])
+				except ValueError:
+					return None
+	return None
+
+# Runs a test like run_test_json() and measures the CPU time spent by
+# testusb (including the usbtest ioctl), by the gadget process if its pid
+# is known, and by the whole system, as well as the system-wide cycles
+# when perf is used. /proc times have the USER_HZ granularity, so runs
+# should last for at least a second for meaningful results.
+def run_test_cpu(device, test, count, length, vary, sglen, args):
+	args_perf = ()
+	perf_file = None
+	if args.perf_stat:
+		perf_file = tempfile.NamedTemporaryFile(suffix=".perf")
+		args_perf = ("perf", "stat", "-a", "-x,", "-e", "cycles",
+				"-o", perf_file.name, "--")
+	host = children_cpu_us()
+	system = system_cpu_us()
+	gadget = proc_cpu_us(args.gadget_pid) if args.gadget_pid else None
+	r = run_test_json(device, test, count, length, vary, sglen,
+				prefix=args_perf)
+	cpu = {
+		"host_us": children_cpu_us() - host,
+		"system_us": system_cpu_us() - system,
+	}
+	if gadget is not None:
+		cpu["gadget_us"] = proc_cpu_us(args.gadget_pid) - gadget
+	if perf_file:
+		cycles = read_perf_cycles(perf_file.name)
+		if cycles is not None:
+			cpu["cycles"] = cycles
+		perf_file.close()
+	return r, cpu
+
+# CPU cost normalized per MB and per transfer moved by a successful run.
+def cpu_costs(r, cpu):
+	mb = r.get("bytes", 0) / 1e6
+	transfers = r["transfers_per_sec"] * r["duration"]
+	costs = {}
+	for (key, value) in cpu.items():
+		if mb > 0:
+			costs[key + "_per_mb"] = value / mb
+		if transfers > 0:
+			costs[key + "_per_transfer"] = value / transfers
+	return costs
+
+def percentile(values, p):
+	values = sorted(values)
+	# Nearest-rank method.
+	k = int(math.ceil(p / 100.0 * len(values))) - 1
+	return values[max(0, min(len(values) - 1, k))]
+
+def summarize(values):
+	if not values:
+		return None
+	return {
+		"median": statistics.median(values),
+		"p95": percentile(values, 95),
+		"stddev": statistics.stdev(values) if len(values) > 1 else 0.0,
+		"min": min(values),
+		"max": max(values),
+	}
+
+def bench_points(test, args):
+	lengths = args.lengths if "length" in test[2] else [1024]
+	sglens = args.sglens if "sglen" in test[2] else [32]
+	for count in args.counts:
+		for length in lengths:
+			for sglen in sglens:
+				yield (count, length, sglen)
+
+def run_bench(device, args):
+	results = []
+	for test in bench_tests:
+		for (count, length, sglen) in bench_points(test, args):
+			print("%s: count %d, length %d, sglen %d" %
+				(test[0], count, length, sglen))
+			durations = []
+			mbps = []
+			costs = {}
+			failures = 0
+			error = 0
+			for i in range(args.repeat):
+				if args.cpu:
+					r, cpu = run_test_cpu(device, test[1],
+						count, length, length, sglen,
+						args)
+				else:
+					r = run_test_json(device, test[1],
+						count, length, length, sglen)
+				if r.get("status") != "success":
+					failures += 1
+					error = r.get("errno", -1)
+					continue
+				durations.append(r["duration"])
+				# Not reported for tests without a known size.
+				if "mbps" in r:
+					mbps.append(r["mbps"])
+				if args.cpu:
+					for (k, v) in cpu_costs(r, cpu).items():
+						costs.setdefault(k, []).append(v)
+			result = {
+				"test": test[0],
+				"num": test[1],
+				"count": count,
+				"length": length,
+				"sglen": sglen,
+				"repeat": args.repeat,
+				"failures": failures,
+				"errno": error,
+				"durations": durations,
+				"duration": summarize(durations),
+				"mbps": summarize(mbps),
+			}
+			if args.cpu:
+				result["cpu"] = dict((k, summarize(v))
+						for (k, v) in costs.items())
+			if result["duration"]:
+				print("median %.6f secs, p95 %.6f secs, "
+					"stddev %.6f, %s MB/s" %
+					(result["duration"]["median"],
+					result["duration"]["p95"],
+					result["duration"]["stddev"],
+					"%.3f" % (result["mbps"]["median"],)
+					if result["mbps"] else "n/a"))
+			else:
+				print("FAILURE: %s" % (error,))
+			if result.get("cpu"):
+				print(", ".join("%s %.3f" % (k, v["median"])
+					for (k, v) in sorted(result["cpu"].items())))
+			results.append(result)
+	return results
+
+def save_bench(results, device, args):
+	metadata = {
+		"device": device,
+		"gadget": args.gadget,
+		"udc": args.udc,
+		"kernel": platform.release(),
+		"machine": platform.machine(),
+		"date": datetime.datetime.now().isoformat(),
+		"repeat": args.repeat,
+		"cpus": os.cpu_count(),
+	}
+	s = json.dumps({"metadata": metadata, "results": results},
+			indent=4, sort_keys=True)
+	with open(args.file, 'w+') as f:
+		f.write(s)
+		f.write("\n")
+
+# Profiling: every test is run under perf record or with the
+# function_graph tracer limited to the raw_gadget and dummy_hcd modules.
+# Stacks are saved in the folded format (one "frame;frame;... value" line
+# per stack), which flamegraph.pl and similar tools accept.
+
+TRACEFS_PATHS = ["/sys/kernel/tracing", "/sys/kernel/debug/tracing"]
+TRACE_MODULES = ["raw_gadget", "dummy_hcd"]
+
+def fold_perf_script(output):
+	# perf script prints a header line per sample followed by one line
+	# per frame, leaf first, and an empty line.
+	folded = {}
+	leaf = {}
+	for sample in output.split("\n\n"):
+		lines = sample.strip().splitlines()
+		if not lines:
+			continue
+		comm = lines[0].split()[0]
+		frames = []
+		for line in lines[1:]:
+			fields = line.split(None, 1)
+			if len(fields) < 2:
+				continue
+			sym = fields[1].rsplit(" (", 1)[0]
+			frames.append(re.sub(r"\+0x[0-9a-f]+$", "", sym))
+		if not frames:
+			continue
+		stack = ";".join([comm] + frames[::-1])
+		folded[stack] = folded.get(stack, 0) + 1
+		leaf[frames[0]] = leaf.get(frames[0], 0) + 1
+	return folded, leaf
+
+def fold_function_graph(output):
+	# Values are in nanoseconds. Each CPU has its own call stack.
+	folded = {}
+	self_time = {}
+	stacks = {}
+	line_re = re.compile(r"^\s*(\d+)\)(.*?)\|(\s*)(.*)$")
+	duration_re = re.compile(r"([\d.]+)\s+us")
+	for line in output.splitlines():
+		m = line_re.match(line)
+		if not m:
+			continue
+		cpu = int(m.group(1))
+		d = duration_re.search(m.group(2))
+		duration = int(float(d.group(1)) * 1000) if d else 0
+		call = m.group(4).strip()
+		stack = stacks.setdefault(cpu, [])
+		if call.endswith("{"):
+			stack.append([call.split("(")[0], 0])
+			continue
+		if call.startswith("}"):
+			if not stack:
+				continue
+			(name, children) = stack.pop()
+			own = max(duration - children, 0)
+			path = [f[0] for f in stack] + [name]
+		elif call.endswith(";"):
+			name = call.split("(")[0]
+			own = duration
+			path = [f[0] for f in stack] + [name]
+		else:
+			continue
+		if stack:
+			stack[-1][1] += duration
+		key = ";".join(path)
+		folded[key] = folded.get(key, 0) + own
+		self_time[name] = self_time.get(name, 0) + own
+	return folded, self_time
+
+def top_functions(values, n):
+	total = sum(values.values()) or 1
+	top = sorted(values.items(), key=lambda x: -x[1])[:n]
+	return [{"function": f, "value": v, "percent": 100.0 * v / total}
+			for (f, v) in top]
+
+def save_folded(folded, filename):
+	with open(filename, "w") as f:
+		for (stack, value) in sorted(folded.items()):
+			if value > 0:
+				f.write("%s %d\n" % (stack, value))
+
+def find_tracefs():
+	for path in TRACEFS_PATHS:
+		if os.path.exists(os.path.join(path, "current_tracer")):
+			return path
+	return None
+
+def tracefs_write(tracefs, name, value, append=False):
+	with open(os.path.join(tracefs, name), "a" if append else "w") as f:
+		f.write(value)
+
+def run_test_perf(device, test, count, prefix, **kwargs):
+	data = prefix + ".perf.data"
+	r = run_test(device, test, count,
+			prefix=("perf", "record", "-a", "-g", "-q",
+				"-o", data, "--"), **kwargs)
+	out = subprocess.run(("perf", "script", "-i", data),
+				stdout=subprocess.PIPE,
+				stderr=subprocess.DEVNULL,
+				universal_newlines=True).stdout
+	folded, leaf = fold_perf_script(out)
+	return r, folded, leaf, "samples"
+
+def run_test_ftrace(device, test, count, tracefs, **kwargs):
+	tracefs_write(tracefs, "tracing_on", "0")
+	tracefs_write(tracefs, "current_tracer", "nop")
+	tracefs_write(tracefs, "set_ftrace_filter", "")
+	filtered = False
+	for module in TRACE_MODULES:
+		try:
+			tracefs_write(tracefs, "set_ftrace_filter",
+					":mod:%s" % (module,), append=True)
+			filtered = True
+		except OSError:
+			print("warning: module %s is not loaded" % (module,))
+	# An empty filter would trace every kernel function.
+	if not filtered:
+		return run_test(device, test, count, **kwargs), {}, {}, "ns"
+	tracefs_write(tracefs, "current_tracer", "function_graph")
+	tracefs_write(tracefs, "trace", "")
+	tracefs_write(tracefs, "tracing_on", "1")
+	try:
+		r = run_test(device, test, count, **kwargs)
+	finally:
+		tracefs_write(tracefs, "tracing_on", "0")
+	with open(os.path.join(tracefs, "trace")) as f:
+		out = f.read()
+	tracefs_write(tracefs, "current_tracer", "nop")
+	tracefs_write(tracefs, "set_ftrace_filter", "")
+	folded, self_time = fold_function_graph(out)
+	return r, folded, self_time, "ns"
+
+def run_test_profile(device, test, count, args, **kwargs):
+	name = "test-%02d" % (test[1],)
+	prefix = os.path.join(args.profile_dir, name)
+	if args.profile == "perf":
+		r, folded, hot, unit = run_test_perf(device, test[1], count,
+							prefix, **kwargs)
+	else:
+		r, folded, hot, unit = run_test_ftrace(device, test[1], count,
+						args.tracefs, **kwargs)
+	save_folded(folded, prefix + ".folded")
+	top = top_functions(hot, args.profile_top)
+	for t in top:
+		print("  %6.2f%% %12d %s  %s" %
+			(t["percent"], t["value"], unit, t["function"]))
+	profile = {
+		"tool": args.profile,
+		"folded": prefix + ".folded",
+		"unit": unit,
+		"top": top,
+	}
+	return r, profile
+
+def run_tests(device, count, args=None):
 	codes = []
+	profiles = []
 	for test in tests:
 		print(test[0])
-		r = run_test(device, test[1], count, **test[2])
+		if args and args.profile:
+			r, p = run_test_profile(device, test, count, args,
+						**test[2])
+			profiles.append(p)
+		else:
+			r = run_test(device, test[1], count, **test[2])
 		print("SUCCESS" if r == 0 else "FAILURE: %s" % (r,))
 		codes.append(r)
-	return codes
+	return codes, profiles
 
-def save_results(codes, filename):
+def save_results(codes, filename, profiles=None):
 	results = []
 	assert len(tests) == len(codes)
 	for (i, c) in enumerate(codes):
 		result = {}
 		result["test"] = tests[i][0]
 		result["code"] = c
+		if profiles:
+			result["profile"] = profiles[i]
 		results.append(result)
 	s = json.dumps(results, indent=4, sort_keys=True)
 	with open(filename, 'w+') as f:
 		f.write(s)
 		f.write("\n")
 
+def int_list(s):
+	return [int(x, 0) for x in s.split(",")]
+
 if __name__ == '__main__':
-	if len(sys.argv) != 3:
-		print("Usage: %s <DEVICE> <FILE>" % (sys.argv[0],))
-		sys.exit(-1)
-	r = run_tests(sys.argv[1], 8)
-	save_results(r, sys.argv[2])
+	parser = argparse.ArgumentParser()
+	parser.add_argument("device", metavar="DEVICE",
+			help="e.g. /dev/bus/usb/005/002")
+	parser.add_argument("file", metavar="FILE", help="results log")
+	parser.add_argument("--bench", action="store_true",
+			help="sweep sizes, s/g lengths and counts, "
+				"and record timing statistics")
+	parser.add_argument("--gadget", default="unknown",
+			help="gadget side implementation, e.g. raw_gadget")
+	parser.add_argument("--udc", default="unknown",
+			help="gadget side UDC, e.g. dummy_udc")
+	parser.add_argument("--repeat", type=int, default=5,
+			help="runs per benchmark point")
+	parser.add_argument("--lengths", type=int_list,
+			default=bench_lengths,
+			help="comma-separated transfer lengths")
+	parser.add_argument("--sglens", type=int_list, default=bench_sglens,
+			help="comma-separated s/g lengths for queued tests")
+	parser.add_argument("--counts", type=int_list, default=bench_counts,
+			help="comma-separated iteration counts")
+	parser.add_argument("--cpu", action="store_true",
+			help="in benchmark mode, also measure CPU time per MB "
+				"and per transfer")
+	parser.add_argument("--gadget-pid", type=int,
+			help="pid of the gadget process to account for "
+				"with --cpu")
+	parser.add_argument("--perf-stat", action="store_true",
+			help="with --cpu, also count system-wide cycles "
+				"with perf stat")
+	parser.add_argument("--profile", choices=("perf", "ftrace"),
+			help="profile every test with perf record -a -g, or "
+				"with the function_graph tracer limited to "
+				"raw_gadget and dummy_hcd")
+	parser.add_argument("--profile-top", type=int, default=10,
+			help="number of hot functions to report")
+	args = parser.parse_args()
+
+	if args.profile and args.bench:
+		parser.error("--profile only works for the regular tests")
+	if (args.profile == "perf" or args.perf_stat) and \
+			not shutil.which("perf"):
+		print("FAILURE: perf is not installed")
+		sys.exit(1)
+
+	if args.profile:
+		args.profile_dir = args.file + ".profile"
+		os.makedirs(args.profile_dir, exist_ok=True)
+		if args.profile == "ftrace":
+			args.tracefs = find_tracefs()
+			if not args.tracefs:
+				print("FAILURE: tracefs is not available")
+				sys.exit(1)
+
+	if args.bench:
+		r = run_bench(args.device, args)
+		save_bench(r, args.device, args)
+		# Let CI notice points that failed.
+		failed = sum(1 for p in r if p["failures"])
+		if failed:
+			print("FAILURE: %d benchmark points failed" % (failed,))
+		sys.exit(1 if failed else 0)
+
+	r, profiles = run_tests(args.device, 8, args)
+	save_results(r, args.file, profiles)
@@ -10,8 +10,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <ftw.h>
+#include <getopt.h>
 #include <limits.h>
 #include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -19,11 +21,14 @@
 
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 
 #include <linux/usb/ch9.h>
 #include <linux/usbdevice_fs.h>
 
+#include "latency.h"
+
 struct usbtest_param {
 	unsigned		test_num;
 	unsigned		iterations;
@@ -44,16 +49,186 @@ static int usbdev_ioctl(int fd, int ifno, unsigned request, void *param) {
 	return ioctl(fd, USBDEVFS_IOCTL, &wrapper);
 }
 
-static int parse_num(const char *str, unsigned int *num) {
-	unsigned long val;
-	char *end;
+// The transfer lengths of the varied tests start at the full length and
+// grow by vary modulo the full length after every transfer, see
+// simple_io() and alloc_sglist() in usbtest.
+static double vary_bytes(unsigned length, unsigned vary, unsigned num) {
+	double bytes = 0;
+	unsigned len = length;
+
+	for (unsigned i = 0; i < num; i++) {
+		bytes += len;
+		if (!vary || !length)
+			continue;
+		len = (len + vary) % length;
+		if (len == 0)
+			len = vary < length ? vary : length;
+	}
+	return bytes;
+}
+
+// Test #14 writes and reads back len bytes per iteration, starting at 1
+// and growing by vary up to length, see ctrl_out() in usbtest. Assumes
+// usbtest is loaded with the default realworld=1.
+static double ctrl_out_bytes(unsigned length, unsigned vary, unsigned num) {
+	double bytes = 0;
+	unsigned len = 1;
+
+	for (unsigned i = 0; i < num; i++) {
+		bytes += 2.0 * len;
+		len += vary;
+		if (len > length)
+			len = 1;
+	}
+	return bytes;
+}
 
-	errno = 0;
-	val = strtoul(str, &end, 0);
-	if (errno || *end || val > UINT_MAX)
+// Bytes moved by a whole test run, or -1 for tests that don't move a
+// known amount of data (ch9 and queued control requests, unlinks, halts).
+// Queued bulk tests submit an s/g list of sglen entries per iteration, iso
+// and queued bulk write/read tests keep sglen URBs of length bytes queued.
+static double test_bytes(const struct usbtest_param *param) {
+	switch (param->test_num) {
+	case 1: case 2: case 17: case 18: case 19: case 20:
+	case 25: case 26:
+		return (double)param->length * param->iterations;
+	case 3: case 4:
+		return vary_bytes(param->length, param->vary,
+					param->iterations);
+	case 5: case 6:
+	case 15: case 16: case 22: case 23: case 27: case 28:
+		return (double)param->length * param->sglen *
+					param->iterations;
+	case 7: case 8:
+		return vary_bytes(param->length, param->vary, param->sglen) *
+					param->iterations;
+	case 14: case 21:
+		return ctrl_out_bytes(param->length, param->vary,
+					param->iterations);
+	default:
 		return -1;
-	*num = val;
-	return 0;
+	}
+}
+
+// Transfers (or control requests) per iteration.
+static unsigned iteration_transfers(const struct usbtest_param *param) {
+	switch (param->test_num) {
+	case 5: case 6: case 7: case 8: case 10:
+	case 15: case 16: case 22: case 23: case 27: case 28:
+		return param->sglen;
+	case 14: case 21:
+		return 2;
+	default:
+		return 1;
+	}
+}
+
+static void print_success(const char *device, const struct usbtest_param *param,
+				bool json) {
+	double secs = param->duration.tv_sec + param->duration.tv_usec / 1e6;
+	double transfers = (double)param->iterations *
+					iteration_transfers(param);
+	double bytes = test_bytes(param);
+	double mbps = 0, tps = 0, latency = 0;
+
+	if (secs > 0) {
+		mbps = bytes / secs / 1e6;
+		tps = transfers / secs;
+	}
+	if (param->iterations)
+		latency = secs * 1e6 / param->iterations;
+
+	if (json) {
+		printf("{\"device\": ");
+		print_json_string(device);
+		printf(", \"test\": %u, "
+			"\"status\": \"success\", \"errno\": 0, "
+			"\"iterations\": %u, \"length\": %u, "
+			"\"vary\": %u, \"sglen\": %u, "
+			"\"duration\": %.6f, ",
+			param->test_num, param->iterations,
+			param->length, param->vary, param->sglen, secs);
+		if (bytes >= 0)
+			printf("\"bytes\": %.0f, \"mbps\": %.3f, ",
+				bytes, mbps);
+		printf("\"transfers_per_sec\": %.1f, "
+			"\"latency_us\": %.3f}\n", tps, latency);
+		return;
+	}
+
+	printf("%s test %02d: SUCCESS: %d.%.06d secs, ",
+		device, param->test_num,
+		(int)param->duration.tv_sec, (int)param->duration.tv_usec);
+	if (bytes >= 0)
+		printf("%.3f MB/s, ", mbps);
+	printf("%.1f transfers/s, %.3f us/iteration\n", tps, latency);
+}
+
+static void print_failure(const char *device, int test, int err, bool json) {
+	char buf[80];
+	if (strerror_r(err, buf, sizeof(buf)))
+		snprintf(buf, sizeof(buf), "error %d", err);
+	if (json) {
+		printf("{\"device\": ");
+		print_json_string(device);
+		printf(", \"test\": %d, "
+			"\"status\": \"failure\", \"errno\": %d, "
+			"\"error\": \"%s\"}\n",
+			test, err, buf);
+	} else
+		printf("%s test %02d: FAILURE: %d (%s)\n",
+			device, test, err, buf);
+}
+
+#define MAX_DEVICES	32
+#define MAX_TESTS	32
+
+// A single test run on a single device, each one runs in its own thread.
+// Note, that usbtest serializes tests on the same device.
+struct job {
+	const char		*device;
+	int			fd;
+	struct usbtest_param	param;
+	int			err;
+	pthread_t		thread;
+};
+
+static void *run_job(void *arg) {
+	struct job *job = arg;
+	int ifnum = 0;
+
+	job->err = 0;
+	if (usbdev_ioctl(job->fd, ifnum, USBTEST_REQUEST, &job->param) < 0)
+		job->err = errno;
+	return NULL;
+}
+
+static void print_summary(struct job *jobs, int num, double wall,
+				bool json) {
+	double bytes = 0;
+	int failed = 0;
+
+	for (int i = 0; i < num; i++) {
+		if (jobs[i].err) {
+			failed++;
+			continue;
+		}
+		if (test_bytes(&jobs[i].param) > 0)
+			bytes += test_bytes(&jobs[i].param);
+	}
+
+	double mbps = wall > 0 ? bytes / wall / 1e6 : 0;
+	if (json) {
+		printf("{\"summary\": true, \"jobs\": %d, \"passed\": %d, "
+			"\"failed\": %d, \"wall\": %.6f, \"bytes\": %.0f, "
+			"\"mbps\": %.3f}\n",
+			num, num - failed, failed, wall, bytes, mbps);
+		return;
+	}
+
+	printf("summary: %d jobs, %d passed, %d failed, %.6f secs, "
+		"%.3f MB/s aggregate\n",
+		num, num - failed, failed, wall, mbps);
 }
 
 int main (int argc, char **argv) {
@@ -63,18 +238,32 @@ int main (int argc, char **argv) {
 	param.vary = 1024;
 	param.sglen = 32;
 
-	char *device = NULL;
-	int test = -1;
+	char *devices[MAX_DEVICES];
+	int devices_num = 0;
+	int tests[MAX_TESTS];
+	int tests_num = 0;
+	bool json = false;
+
+	static const struct option long_options[] = {
+		{"json", no_argument, NULL, 'j'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0},
+	};
 
 	int opt;
-	while ((opt = getopt(argc, argv, "D:t:c:s:v:g:h")) != EOF) {
+	while ((opt = getopt_long(argc, argv, "D:t:c:s:v:g:jh",
+					long_options, NULL)) != EOF) {
 		switch (opt) {
 		case 'D':  // Device path, e.g. /dev/bus/usb/005/003.
-			device = optarg;
+			if (devices_num == MAX_DEVICES)
+				goto usage;
+			devices[devices_num++] = optarg;
 			continue;
 		case 't':  // Test number.
-			test = atoi(optarg);
-			if (test < 0)
+			if (tests_num == MAX_TESTS)
+				goto usage;
+			tests[tests_num] = atoi(optarg);
+			if (tests[tests_num++] < 0)
 				goto usage;
 			continue;
 		case 'c':  // Iterations number.
@@ -93,19 +282,26 @@ int main (int argc, char **argv) {
 			if (parse_num(optarg, &param.sglen))
 				goto usage;
 			continue;
+		case 'j':  // Machine-readable output.
+			json = true;
+			continue;
 		case 'h':
 		default:
 usage:
 			fprintf (stderr,
 				"usage: %s [options]\n"
 				"Options:\n"
-				"\t-D device path\n"
-				"\t-t test number\n"
+				"\t-D device path\t\tcan be repeated\n"
+				"\t-t test number\t\tcan be repeated\n"
+				"\t-j, --json\t\tprint results as JSON\n"
 				"Case arguments:\n"
 				"\t-c iterations\t\tdefault 1000\n"
 				"\t-s transfer length\tdefault 1024\n"
 				"\t-v vary\t\t\tdefault 1024\n"
-				"\t-g s/g length\t\tdefault 32\n",
+				"\t-g s/g length\t\tdefault 32\n"
+				"With several devices or tests, every test is run "
+				"on every device,\nall in parallel threads, and a "
+				"summary is printed in the end.\n",
 				argv[0]);
 			return EXIT_FAILURE;
 		}
@@ -113,36 +309,65 @@ usage:
 
 	if (optind != argc)
 		goto usage;
-	if (!device)
+	if (!devices_num)
 		goto usage;
-	if (test == -1)
+	if (!tests_num)
 		goto usage;
 
-	param.test_num = test;
-
-	int fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open(device)");
+	int jobs_num = devices_num * tests_num;
+	struct job *jobs = calloc(jobs_num, sizeof(jobs[0]));
+	if (!jobs) {
+		perror("calloc()");
 		return EXIT_FAILURE;
 	}
 
-	int ifnum = 0;
-	int status = usbdev_ioctl(fd, ifnum, USBTEST_REQUEST, &param);
-
-	if (status < 0) {
-		char buf[80];
-		int err = errno;
-		if (strerror_r(errno, buf, sizeof(buf))) {
-			snprintf(buf, sizeof(buf), "error %d", err);
-			errno = err;
+	for (int d = 0; d < devices_num; d++) {
+		int fd = open(devices[d], O_RDWR);
+		if (fd < 0) {
+			perror("open(device)");
+			return EXIT_FAILURE;
 		}
-		printf("%s test %02d: FAILURE: %d (%s)\n",
-			device, test, errno, buf);
-		return errno;
+		for (int t = 0; t < tests_num; t++) {
+			struct job *job = &jobs[d * tests_num + t];
+			job->device = devices[d];
+			job->fd = fd;
+			job->param = param;
+			job->param.test_num = tests[t];
+		}
+	}
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+	if (jobs_num == 1) {
+		run_job(&jobs[0]);
+	} else {
+		for (int i = 0; i < jobs_num; i++) {
+			if (pthread_create(&jobs[i].thread, NULL,
+						run_job, &jobs[i])) {
+				perror("pthread_create()");
+				return EXIT_FAILURE;
+			}
+		}
+		for (int i = 0; i < jobs_num; i++)
+			pthread_join(jobs[i].thread, NULL);
+	}
+	gettimeofday(&end, NULL);
+
+	int status = EXIT_SUCCESS;
+	for (int i = 0; i < jobs_num; i++) {
+		if (jobs[i].err) {
+			print_failure(jobs[i].device, jobs[i].param.test_num,
+						jobs[i].err, json);
+			if (status == EXIT_SUCCESS)
+				status = jobs[i].err;
+			continue;
+		}
+		print_success(jobs[i].device, &jobs[i].param, json);
 	}
 
-	printf("%s test %02d: SUCCESS: %d.%.06d secs\n", device, test,
-		(int)param.duration.tv_sec, (int)param.duration.tv_usec);
+	if (jobs_num > 1)
+		print_summary(jobs, jobs_num, (end.tv_sec - start.tv_sec) +
+				(end.tv_usec - start.tv_usec) / 1e6, json);
 
-	return EXIT_SUCCESS;
+	return status;
 }